@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL/SDL.h>
 #include "image.h"
+#include "jpegdecoder.h"
 
 static int max_int_2(int x1, int x2)
 {
@@ -9,38 +11,47 @@ static int max_int_2(int x1, int x2)
 	return x2;
 }
 
-static void display_image_sdl(Image *image) {
-	SDL_Surface *screen;
-	SDL_Event event;
-	int run = 1;
-	uint32_t x, y, window_size_x, window_size_y;
-	uint8_t *p;
+/* opened as soon as the decoder knows the image size, so the image is
+	decoded straight into the window's pixels */
+static uint8_t *open_window_sdl(void *user, unsigned width, unsigned height,
+	size_t *stride)
+{
+	SDL_Surface **screen = (SDL_Surface **)user;
 
 	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
 		printf("unable to initialize SDL: %s\n", SDL_GetError());
-		return;
+		return NULL;
 	}
 
-	window_size_x = max_int_2(100, image->size_x);
-	window_size_y = max_int_2(100, image->size_y);
-
-	screen = SDL_SetVideoMode(window_size_x, window_size_y, 32, SDL_DOUBLEBUF);
-	if (screen == NULL) {
+	*screen = SDL_SetVideoMode(max_int_2(100, width), max_int_2(100, height),
+		32, SDL_DOUBLEBUF);
+	if (*screen == NULL) {
 		fprintf(stderr, "unable to set video mode: %s\n", SDL_GetError());
-		return;
+		return NULL;
 	}
 
-	SDL_LockSurface(screen);
-
-	for (y=0; y<image->size_y; y++) {
-		for (x=0; x<image->size_x; x++) {
-			p = ((uint8_t *)screen->pixels)+y*screen->pitch+x*screen->format->BytesPerPixel;
-			p[0] = (image->data+(x*3)+(y*image->total_x*3))[0];
-			p[1] = (image->data+(x*3)+(y*image->total_x*3))[1];
-			p[2] = (image->data+(x*3)+(y*image->total_x*3))[2];
-		}
+	/* decoding as BGRA */
+	if ((*screen)->format->BytesPerPixel != 4
+		|| (*screen)->format->Bshift != 0
+		|| (*screen)->format->Gshift != 8
+		|| (*screen)->format->Rshift != 16
+	) {
+		fprintf(stderr, "unsupported screen pixel format\n");
+		return NULL;
 	}
 
+	if (SDL_LockSurface(*screen) != 0)
+		return NULL;
+
+	*stride = (*screen)->pitch;
+	return (uint8_t *)(*screen)->pixels;
+}
+
+static void display_image_sdl(SDL_Surface *screen) {
+	SDL_Event event;
+	int run = 1;
+
+	SDL_UnlockSurface(screen);
 	SDL_Flip(screen);
 
 	while (run) {
@@ -63,35 +74,210 @@ static void display_image_sdl(Image *image) {
 		}
 	}
 	}
-	SDL_Quit();
+}
+
+/* feed the file to the decoder a chunk at a time, as if it were arriving over
+	a connection */
+static Image_Result read_stream(Image *image, FILE *file,
+	const JPEGDecoder_Options *options)
+{
+	JPEGStream *stream;
+	uint8_t buffer[16384];
+	size_t n;
+	Image_Result result = IMAGE_RESULT_SUCCESS;
+
+	stream = JPEGStream_new(image, options);
+	if (!stream)
+		return IMAGE_RESULT_FAILURE;
+
+	while (result && (n = fread(buffer, 1, sizeof buffer, file)) > 0)
+		result = JPEGStream_push(stream, buffer, n);
+
+	if (result)
+		result = JPEGStream_finish(stream);
+
+	JPEGStream_delete(stream);
+	return result;
+}
+
+/* DC-only statistics instead of showing the image */
+static int print_stats(FILE *file, const JPEGDecoder_Options *options)
+{
+	JPEGStats stats;
+	unsigned i, k, count;
+
+	JPEGStats_construct(&stats);
+	if (!JPEGStats_read_file(&stats, file, options)) {
+		fprintf(stderr, "could not read input file\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("preview %u x %u\n", (unsigned)stats.preview.size_x,
+		(unsigned)stats.preview.size_y);
+	printf("mean R %.1f G %.1f B %.1f\n",
+		stats.mean[2], stats.mean[1], stats.mean[0]);
+	printf("luma histogram :");
+	for (i = 0; i < 256; i += 16) {
+		for (count = 0, k = i; k < i + 16; k++)
+			count += stats.histogram[k];
+		printf(" %u", count);
+	}
+	printf("\n");
+
+	JPEGStats_destruct(&stats);
+	return EXIT_SUCCESS;
+}
+
+/* the headers alone, without decoding */
+static int print_info(FILE *file)
+{
+	JPEGInfo info;
+	unsigned i;
+
+	if (!JPEGInfo_read_file(&info, file)) {
+		fprintf(stderr, "not a JPEG file\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%u x %u, %u bit, %u components,", info.width, info.height,
+		info.precision, info.components);
+	for (i = 0; i < info.components && i < 4; i++)
+		printf(" %ux%u", info.sub_x[i], info.sub_y[i]);
+	printf("\nSOF%u%s%s, restart interval %u, orientation %u\n",
+		info.sof - 0xc0, info.progressive ? " progressive" : "",
+		info.arithmetic ? " arithmetic" : "", info.restart_interval,
+		info.orientation);
+	if (info.thumbnail_size) {
+		printf("EXIF thumbnail of %lu bytes at %lu\n",
+			(unsigned long)info.thumbnail_size,
+			(unsigned long)info.thumbnail_offset);
+	}
+	printf("%s\n", info.supported ? "supported" : "not supported");
+
+	return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[])
 {
 	Image image;
+	SDL_Surface *screen = NULL;
+	JPEGDecoder_Options options;
+	FILE *file;
+	JPEGIndex *index = NULL;
+	FILE *index_file;
+	int i, stream = 0, stats = 0, info = 0, thumbnail = 0;
 	int exit_code = EXIT_SUCCESS;
-	const char *file_name = NULL;
+	unsigned thumbnail_width = 0, thumbnail_height = 0;
+	const char *file_name = NULL, *index_name = NULL;
+
+	JPEGDecoder_Options_construct(&options);
+	options.output = JPEGDECODER_OUTPUT_BGRA;
+	options.buffer = open_window_sdl;
+	options.buffer_user = &screen;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-idct") == 0 && i + 1 < argc) {
+			options.idct = JPEGDecoder_IDCT_from_name(argv[++i]);
+			if (options.idct == JPEGDECODER_IDCT_COUNT) {
+				fprintf(stderr, "unknown IDCT '%s' (auto, islow, float, sse2, avx2)\n",
+					argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			options.threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-pipeline") == 0) {
+			options.pipeline = 1;
+		} else if (strcmp(argv[i], "-scale") == 0 && i + 1 < argc) {
+			options.scale = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-crop") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%u,%u,%u,%u", &options.crop_x,
+				&options.crop_y, &options.crop_width, &options.crop_height) != 4)
+				break;
+		} else if (strcmp(argv[i], "-index") == 0 && i + 1 < argc) {
+			index_name = argv[++i];
+		} else if (strcmp(argv[i], "-stream") == 0) {
+			stream = 1;
+		} else if (strcmp(argv[i], "-stats") == 0) {
+			stats = 1;
+		} else if (strcmp(argv[i], "-info") == 0) {
+			info = 1;
+		} else if (strcmp(argv[i], "-thumbnail") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%u,%u", &thumbnail_width,
+				&thumbnail_height) != 2)
+				break;
+			thumbnail = 1;
+		} else if (!file_name && argv[i][0] != '-') {
+			file_name = argv[i];
+		} else {
+			break;
+		}
+	}
 
-	if (argc == 2) {
-		file_name = argv[1];
-	} else {
-		fprintf(stderr, "syntax: <filename>\n");
+	if (i != argc || !file_name) {
+		fprintf(stderr, "syntax: [-idct <name>] [-threads <n>] [-pipeline] [-scale <n>] [-crop <x>,<y>,<w>,<h>] [-index <sidecar>] [-stream] [-stats] [-info] [-thumbnail <w>,<h>] <filename>\n");
 		return EXIT_FAILURE;
 	}
 
 	Image_construct(&image);
 	Image_log_level_set(&image, IMAGE_LOGLEVEL_INFO);
 
-	if (!Image_read_format_filename(&image, "JPEG", file_name)) {
+	file = fopen(file_name, "rb");
+	if (!file) {
+		fprintf(stderr, "could not open input file '%s'\n", file_name);
+		return EXIT_FAILURE;
+	}
+
+	if (info) {
+		exit_code = print_info(file);
+		fclose(file);
+		return exit_code;
+	}
+
+	/* the sidecar index is made the first time and used from then on */
+	if (index_name) {
+		index_file = fopen(index_name, "rb");
+		if (index_file) {
+			index = JPEGIndex_read(index_file);
+			fclose(index_file);
+		}
+		if (!index) {
+			index = JPEGIndex_build_file(file, 0);
+			index_file = index ? fopen(index_name, "wb") : NULL;
+			if (index_file) {
+				JPEGIndex_write(index, index_file);
+				fclose(index_file);
+			}
+			rewind(file);
+		}
+		options.index = index;
+	}
+
+	if (stats) {
+		exit_code = print_stats(file, &options);
+		fclose(file);
+		JPEGIndex_delete(index);
+		return exit_code;
+	}
+
+	if (!(stream ? read_stream(&image, file, &options)
+		: thumbnail ? JPEGThumbnail_read_file(&image, file, thumbnail_width,
+			thumbnail_height, &options)
+		: Image_read_format_file_JPEG_options(&image, file, &options))) {
 		fprintf(stderr, "could not read input file: %s\n", Image_lasterror_string(&image));
 		exit_code = EXIT_FAILURE;
+		fclose(file);
 		goto finish;
 	}
+	fclose(file);
 
-	display_image_sdl(&image);
+	/* the window is only opened once the decoder has the image size */
+	if (screen)
+		display_image_sdl(screen);
 
 finish:
+	SDL_Quit();
 	Image_destruct(&image);
+	JPEGIndex_delete(index);
 
 	return exit_code;
 }
@@ -9,11 +9,13 @@
 #include <strings.h>
 
 #include "image.h"
+#include "jpegdecoder.h"
 
 void Image_construct(Image *this)
 {
 	this->size_x = this->size_y = 0;
 	this->data = 0;
+	this->planes = 0;
 }
 
 void Image_construct_size_channels(
@@ -70,8 +72,15 @@ void Image_construct_size_total_channels(
 
 void Image_destruct(Image *this)
 {
+	unsigned i;
+
 	if (this->data)
 		free(this->data);
+	/* left empty, so that a reusable decoder can't mistake freed pixels
+		for its own */
+	this->data = 0;
+	for (i = 0; i < 3; i++)
+		this->plane[i].data = 0;
 }
 
 Image_Result Image_write_format_filename(
@@ -108,6 +117,11 @@ Image_Result Image_write_format_file_TGA(Image *this, FILE *file)
 	uint8_t header[18] = { 0 };
 	uint_fast16_t row;
 
+	if (this->planes) {
+		Image_log(this, IMAGE_LOGLEVEL_FATAL, "TGA needs interleaved pixels\n");
+		return IMAGE_RESULT_FAILURE;
+	}
+
 	header[2] = 2; /* image type */
 	header[7] = 32; /* colour map bits (we have no colour map but some apps
 		require this field to be set) */
@@ -154,7 +168,7 @@ Image_Result Image_read_format_file_JPEG(
   Image *this,
 	FILE *file)
 {
-	return Image_read_format_memory_wrap_file(this, file, Image_read_format_memory_JPEG);
+	return Image_read_format_file_JPEG_options(this, file, NULL);
 }
 
 void Image_log_level_set(Image *image, Image_LogLevel log_level) {
@@ -4,11 +4,23 @@
 #include <stdio.h>
 #include <stdint.h>
 
+/* one component of a planar image, within Image.data */
+typedef struct Image_Plane_t {
+	uint8_t *data;
+	uint_fast32_t size_x, size_y; /* at the component's own resolution */
+	uint_fast32_t stride; /* bytes from one row to the next */
+	uint_fast8_t step; /* bytes from one sample to the next */
+} Image_Plane;
+
 typedef struct Image_t {
 	uint8_t *data;
 	uint_fast32_t size_x, size_y;
 	uint_fast32_t total_x, total_y;
 	uint_fast8_t channels;
+	/* 0 : the channels are interleaved, 'channels' bytes per pixel.
+		Otherwise each channel has its own plane. */
+	uint_fast8_t planes;
+	Image_Plane plane[3];
 } Image;
 
 typedef enum Image_LogLevel_t {
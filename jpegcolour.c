@@ -0,0 +1,138 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jpegcolour.h"
+
+static uint8_t clamp_u8(int x)
+{
+	if (x < 0) { return 0; }
+	if (x > 255) { return 255; }
+	return x;
+}
+
+/* convert one pixel and write it in format 'output', returning where the
+	next one goes */
+static inline __attribute__((always_inline)) uint8_t *put_pixel(uint8_t *out,
+	int y, int cb, int cr, const JPEGDecoder_Output output, uint8_t alpha)
+{
+	uint8_t r, g, b;
+	unsigned v;
+
+	cb -= 128;
+	cr -= 128;
+	b = clamp_u8(y + ((YCC_FIX(1.77200)*cb + YCC_ONE_HALF) >> YCC_SCALEBITS));
+	g = clamp_u8(y + ((-YCC_FIX(0.34414)*cb - YCC_FIX(0.71414)*cr
+		+ YCC_ONE_HALF) >> YCC_SCALEBITS));
+	r = clamp_u8(y + ((YCC_FIX(1.40200)*cr + YCC_ONE_HALF) >> YCC_SCALEBITS));
+
+	switch (output) {
+	case JPEGDECODER_OUTPUT_RGB:
+		out[0] = r; out[1] = g; out[2] = b;
+		return out + 3;
+	case JPEGDECODER_OUTPUT_BGRA:
+		out[0] = b; out[1] = g; out[2] = r; out[3] = alpha;
+		return out + 4;
+	case JPEGDECODER_OUTPUT_RGBA:
+		out[0] = r; out[1] = g; out[2] = b; out[3] = alpha;
+		return out + 4;
+	case JPEGDECODER_OUTPUT_RGB565:
+		v = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+		out[0] = v;
+		out[1] = v >> 8;
+		return out + 2;
+	default:
+		out[0] = b; out[1] = g; out[2] = r;
+		return out + 3;
+	}
+}
+
+void JPEGColour_row(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+	const unsigned *h, uint8_t *out, unsigned n, JPEGDecoder_Output output,
+	uint8_t alpha)
+{
+	unsigned x;
+
+	for (x = 0; x < n; x++)
+		out = put_pixel(out, y[x / h[0]], cb[x / h[1]], cr[x / h[2]], output,
+			alpha);
+}
+
+/* chroma sample x >> shift for pixel x */
+static inline __attribute__((always_inline)) void scalar_row(
+	const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out,
+	unsigned n, uint8_t alpha, const unsigned shift,
+	const JPEGDecoder_Output output)
+{
+	unsigned x;
+
+	for (x = 0; x < n; x++)
+		out = put_pixel(out, y[x], cb[x >> shift], cr[x >> shift], output, alpha);
+}
+
+/* cb = cr = 128 leaves y as it is in every channel */
+static inline __attribute__((always_inline)) void scalar_grey_row(
+	const uint8_t *y, uint8_t *out, unsigned n, uint8_t alpha,
+	const JPEGDecoder_Output output)
+{
+	unsigned x;
+
+	for (x = 0; x < n; x++)
+		out = put_pixel(out, y[x], 128, 128, output, alpha);
+}
+
+#define SCALAR_ROWS(name, output) \
+static void name##_h1(const uint8_t *y, const uint8_t *cb, \
+	const uint8_t *cr, uint8_t *out, unsigned n, uint8_t alpha) \
+{ \
+	scalar_row(y, cb, cr, out, n, alpha, 0, output); \
+} \
+static void name##_h2(const uint8_t *y, const uint8_t *cb, \
+	const uint8_t *cr, uint8_t *out, unsigned n, uint8_t alpha) \
+{ \
+	scalar_row(y, cb, cr, out, n, alpha, 1, output); \
+} \
+static void name##_grey(const uint8_t *y, const uint8_t *cb, \
+	const uint8_t *cr, uint8_t *out, unsigned n, uint8_t alpha) \
+{ \
+	(void)cb; \
+	(void)cr; \
+	scalar_grey_row(y, out, n, alpha, output); \
+}
+
+SCALAR_ROWS(bgr, JPEGDECODER_OUTPUT_BGR)
+SCALAR_ROWS(rgb, JPEGDECODER_OUTPUT_RGB)
+SCALAR_ROWS(bgra, JPEGDECODER_OUTPUT_BGRA)
+SCALAR_ROWS(rgba, JPEGDECODER_OUTPUT_RGBA)
+SCALAR_ROWS(rgb565, JPEGDECODER_OUTPUT_RGB565)
+
+const JPEGColourEngine JPEGColour_scalar = { "scalar", {
+	{ bgr_h1, bgr_h2, bgr_grey },
+	{ NULL, NULL, NULL }, /* I420 */
+	{ NULL, NULL, NULL }, /* NV12 */
+	{ rgb_h1, rgb_h2, rgb_grey },
+	{ bgra_h1, bgra_h2, bgra_grey },
+	{ rgba_h1, rgba_h2, rgba_grey },
+	{ rgb565_h1, rgb565_h2, rgb565_grey }
+} };
+
+#if !defined(__x86_64__) && !defined(__i386__)
+const JPEGColourEngine JPEGColour_sse2 = { "sse2", { { NULL, NULL, NULL } } };
+const JPEGColourEngine JPEGColour_avx2 = { "avx2", { { NULL, NULL, NULL } } };
+#endif
+
+static const JPEGColourEngine *const engines[JPEGDECODER_IDCT_COUNT] = {
+	NULL, /* auto */
+	&JPEGColour_scalar, /* islow */
+	&JPEGColour_scalar, /* float */
+	&JPEGColour_sse2,
+	&JPEGColour_avx2
+};
+
+const JPEGColourEngine *JPEGColour_engine(JPEGDecoder_IDCT idct)
+{
+	if (idct == JPEGDECODER_IDCT_AUTO)
+		idct = JPEGDecoder_IDCT_best();
+	if (!JPEGDecoder_IDCT_supported(idct))
+		return &JPEGColour_scalar;
+	return engines[idct];
+}
@@ -0,0 +1,54 @@
+#ifndef INCLUDE_JPEGCOLOUR_H
+#define INCLUDE_JPEGCOLOUR_H
+
+#include <stdint.h>
+
+#include "jpegdecoder.h"
+
+/* YCbCr -> RGB in 16-bit fixed point, exactly as libjpeg does it */
+#define YCC_SCALEBITS 16
+#define YCC_ONE_HALF (1 << (YCC_SCALEBITS-1))
+#define YCC_FIX(x) ((int)((x) * (1 << YCC_SCALEBITS) + 0.5))
+
+/* bytes per pixel of a packed output */
+#define JPEGCOLOUR_PIXEL_SIZE(output) \
+	((output) == JPEGDECODER_OUTPUT_RGB565 ? 2 \
+	: (output) == JPEGDECODER_OUTPUT_BGRA || (output) == JPEGDECODER_OUTPUT_RGBA ? 4 \
+	: 3)
+
+/*
+Convert one row of 'n' pixels, written to 'out' in one of the packed output
+formats ('alpha' filling in the alpha channel if it has one).  'y' has n
+samples; 'cb' and 'cr' have n for h1 (4:4:4, 4:4:0), or (n+1)/2 for h2
+(4:2:2, 4:2:0) where each chroma sample covers two pixels side by side.
+Vertical upsampling is up to the caller, which passes the same chroma row
+again for the second luma row.  Nothing is written past the n pixels.
+Greyscale kernels put the luma sample in every colour channel and don't look
+at cb and cr.
+*/
+typedef void (*JPEGColourRow)(const uint8_t *y, const uint8_t *cb,
+	const uint8_t *cr, uint8_t *out, unsigned n, uint8_t alpha);
+
+typedef struct JPEGColourEngine_t {
+	const char *name;
+	/* for each output, h1, h2 and greyscale kernels; NULL for the planar
+		outputs */
+	JPEGColourRow row[JPEGDECODER_OUTPUT_COUNT][3];
+} JPEGColourEngine;
+
+/* the SIMD engines are bit-exact with the scalar one */
+extern const JPEGColourEngine JPEGColour_scalar;
+extern const JPEGColourEngine JPEGColour_sse2;
+extern const JPEGColourEngine JPEGColour_avx2;
+
+/* kernels using the same instruction set as IDCT engine 'idct' (AUTO
+	resolved through cpuid), so forcing the scalar IDCT forces scalar colour
+	conversion too */
+const JPEGColourEngine *JPEGColour_engine(JPEGDecoder_IDCT idct);
+
+/* any other sampling : pixel x takes sample x / h[i] of component i */
+void JPEGColour_row(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+	const unsigned *h, uint8_t *out, unsigned n, JPEGDecoder_Output output,
+	uint8_t alpha);
+
+#endif
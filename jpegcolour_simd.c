@@ -0,0 +1,329 @@
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "jpegcolour.h"
+
+/* 4 pixels as BGR0 in the 32-bit lanes of 'p' -> 12 bytes at the bottom */
+__attribute__((target("sse2")))
+static inline __m128i pack3_sse2(__m128i p)
+{
+	const __m128i lo = _mm_set1_epi64x(0xffffff);
+	const __m128i hi = _mm_set1_epi64x(0xffffff000000);
+
+	p = _mm_or_si128(_mm_and_si128(p, lo),
+		_mm_and_si128(_mm_srli_epi64(p, 8), hi));
+	return _mm_or_si128(_mm_move_epi64(p),
+		_mm_slli_si128(_mm_srli_si128(p, 8), 6));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i load_sse2(const uint8_t *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+/* 8 chroma samples, each doubled */
+__attribute__((target("sse2")))
+static inline __m128i load_dup_sse2(const uint8_t *p)
+{
+	__m128i c = _mm_loadl_epi64((const __m128i *)p);
+
+	return _mm_unpacklo_epi8(c, c);
+}
+
+/* interleave 16 pixels into 48 bytes, first plane first */
+__attribute__((target("sse2")))
+static inline void store_bgr_sse2(uint8_t *out, __m128i b, __m128i g,
+	__m128i r)
+{
+	__m128i zero, bg, r0, c0, c1, c2, c3;
+
+	zero = _mm_setzero_si128();
+	bg = _mm_unpacklo_epi8(b, g);
+	r0 = _mm_unpacklo_epi8(r, zero);
+	c0 = pack3_sse2(_mm_unpacklo_epi16(bg, r0));
+	c1 = pack3_sse2(_mm_unpackhi_epi16(bg, r0));
+	bg = _mm_unpackhi_epi8(b, g);
+	r0 = _mm_unpackhi_epi8(r, zero);
+	c2 = pack3_sse2(_mm_unpacklo_epi16(bg, r0));
+	c3 = pack3_sse2(_mm_unpackhi_epi16(bg, r0));
+
+	_mm_storeu_si128((__m128i *)out,
+		_mm_or_si128(c0, _mm_slli_si128(c1, 12)));
+	_mm_storeu_si128((__m128i *)(out + 16),
+		_mm_or_si128(_mm_srli_si128(c1, 4), _mm_slli_si128(c2, 8)));
+	_mm_storeu_si128((__m128i *)(out + 32),
+		_mm_or_si128(_mm_srli_si128(c2, 8), _mm_slli_si128(c3, 4)));
+}
+
+/* 16 pixels of 4 bytes, the fourth 'a' */
+__attribute__((target("sse2")))
+static inline void store_bgra_sse2(uint8_t *out, __m128i b, __m128i g,
+	__m128i r, __m128i a)
+{
+	__m128i bg, ra;
+
+	bg = _mm_unpacklo_epi8(b, g);
+	ra = _mm_unpacklo_epi8(r, a);
+	_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi16(bg, ra));
+	bg = _mm_unpackhi_epi8(b, g);
+	ra = _mm_unpackhi_epi8(r, a);
+	_mm_storeu_si128((__m128i *)(out + 32), _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i *)(out + 48), _mm_unpackhi_epi16(bg, ra));
+}
+
+/* 8 pixels of b, g and r widened to 16 bits -> RGB565 */
+__attribute__((target("sse2")))
+static inline __m128i pack565_sse2(__m128i b, __m128i g, __m128i r)
+{
+	return _mm_or_si128(_mm_or_si128(
+		_mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xf8)), 8),
+		_mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xfc)), 3)),
+		_mm_srli_epi16(b, 3));
+}
+
+__attribute__((target("sse2")))
+static inline void store_565_sse2(uint8_t *out, __m128i b, __m128i g,
+	__m128i r)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	_mm_storeu_si128((__m128i *)out, pack565_sse2(_mm_unpacklo_epi8(b, zero),
+		_mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(r, zero)));
+	_mm_storeu_si128((__m128i *)(out + 16), pack565_sse2(
+		_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(g, zero),
+		_mm_unpackhi_epi8(r, zero)));
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void store_sse2(uint8_t *out,
+	__m128i b, __m128i g, __m128i r, __m128i a, const JPEGDecoder_Output output)
+{
+	switch (output) {
+	case JPEGDECODER_OUTPUT_RGB: store_bgr_sse2(out, r, g, b); break;
+	case JPEGDECODER_OUTPUT_BGRA: store_bgra_sse2(out, b, g, r, a); break;
+	case JPEGDECODER_OUTPUT_RGBA: store_bgra_sse2(out, r, g, b, a); break;
+	case JPEGDECODER_OUTPUT_RGB565: store_565_sse2(out, b, g, r); break;
+	default: store_bgr_sse2(out, b, g, r); break;
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load_avx2(const uint8_t *p)
+{
+	return _mm256_loadu_si256((const __m256i *)p);
+}
+
+/* 16 chroma samples, each doubled */
+__attribute__((target("avx2")))
+static inline __m256i load_dup_avx2(const uint8_t *p)
+{
+	__m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+
+	return _mm256_or_si256(c, _mm256_slli_epi16(c, 8));
+}
+
+/* byte of each plane going to each byte of 16 output bytes, per 128-bit lane
+	(-1 : none), for output bytes 0-15, 16-31 and 32-47 of the lane's 16 pixels */
+static const int8_t bgr_shuffle[9][16] = {
+	{ 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1,-1, 5},
+	{-1, 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1,-1},
+	{-1,-1, 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1},
+	{-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1,10,-1},
+	{ 5,-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1,10},
+	{-1, 5,-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1},
+	{-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1,-1},
+	{-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1},
+	{10,-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15}
+};
+
+__attribute__((target("avx2")))
+static inline __m256i shuffle_avx2(__m256i v, int i)
+{
+	return _mm256_shuffle_epi8(v, _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)bgr_shuffle[i])));
+}
+
+/* interleave 32 pixels into 96 bytes */
+__attribute__((target("avx2")))
+static inline void store_bgr_avx2(uint8_t *out, __m256i b, __m256i g,
+	__m256i r)
+{
+	__m256i o[3];
+	int t;
+
+	for (t = 0; t < 3; t++)
+		o[t] = _mm256_or_si256(_mm256_or_si256(shuffle_avx2(b, t*3),
+			shuffle_avx2(g, t*3 + 1)), shuffle_avx2(r, t*3 + 2));
+
+	for (t = 0; t < 3; t++) {
+		_mm_storeu_si128((__m128i *)(out + t*16),
+			_mm256_castsi256_si128(o[t]));
+		_mm_storeu_si128((__m128i *)(out + 48 + t*16),
+			_mm256_extracti128_si256(o[t], 1));
+	}
+}
+
+/* unpacks work within 128-bit lanes : 'lo' has pixels 0-7 and 16-23 of a
+	step, 'hi' 8-15 and 24-31; store them in order */
+__attribute__((target("avx2")))
+static inline void store_lanes_avx2(uint8_t *out, __m256i lo, __m256i hi)
+{
+	_mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *)(out + 32),
+		_mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+/* 32 pixels of 4 bytes, the fourth 'a' */
+__attribute__((target("avx2")))
+static inline void store_bgra_avx2(uint8_t *out, __m256i b, __m256i g,
+	__m256i r, __m256i a)
+{
+	__m256i bg, ra, lo[2], hi[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		bg = i ? _mm256_unpackhi_epi8(b, g) : _mm256_unpacklo_epi8(b, g);
+		ra = i ? _mm256_unpackhi_epi8(r, a) : _mm256_unpacklo_epi8(r, a);
+		lo[i] = _mm256_unpacklo_epi16(bg, ra);
+		hi[i] = _mm256_unpackhi_epi16(bg, ra);
+	}
+
+	/* pixels 0-3 and 16-19 | 4-7 and 20-23, then 8-11 and 24-27 | 12-15 and 28-31 */
+	_mm256_storeu_si256((__m256i *)out,
+		_mm256_permute2x128_si256(lo[0], hi[0], 0x20));
+	_mm256_storeu_si256((__m256i *)(out + 32),
+		_mm256_permute2x128_si256(lo[1], hi[1], 0x20));
+	_mm256_storeu_si256((__m256i *)(out + 64),
+		_mm256_permute2x128_si256(lo[0], hi[0], 0x31));
+	_mm256_storeu_si256((__m256i *)(out + 96),
+		_mm256_permute2x128_si256(lo[1], hi[1], 0x31));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack565_avx2(__m256i b, __m256i g, __m256i r)
+{
+	return _mm256_or_si256(_mm256_or_si256(
+		_mm256_slli_epi16(_mm256_and_si256(r, _mm256_set1_epi16(0xf8)), 8),
+		_mm256_slli_epi16(_mm256_and_si256(g, _mm256_set1_epi16(0xfc)), 3)),
+		_mm256_srli_epi16(b, 3));
+}
+
+__attribute__((target("avx2")))
+static inline void store_565_avx2(uint8_t *out, __m256i b, __m256i g,
+	__m256i r)
+{
+	__m256i zero = _mm256_setzero_si256();
+
+	store_lanes_avx2(out,
+		pack565_avx2(_mm256_unpacklo_epi8(b, zero),
+			_mm256_unpacklo_epi8(g, zero), _mm256_unpacklo_epi8(r, zero)),
+		pack565_avx2(_mm256_unpackhi_epi8(b, zero),
+			_mm256_unpackhi_epi8(g, zero), _mm256_unpackhi_epi8(r, zero)));
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void store_avx2(uint8_t *out,
+	__m256i b, __m256i g, __m256i r, __m256i a, const JPEGDecoder_Output output)
+{
+	switch (output) {
+	case JPEGDECODER_OUTPUT_RGB: store_bgr_avx2(out, r, g, b); break;
+	case JPEGDECODER_OUTPUT_BGRA: store_bgra_avx2(out, b, g, r, a); break;
+	case JPEGDECODER_OUTPUT_RGBA: store_bgra_avx2(out, r, g, b, a); break;
+	case JPEGDECODER_OUTPUT_RGB565: store_565_avx2(out, b, g, r); break;
+	default: store_bgr_avx2(out, b, g, r); break;
+	}
+}
+
+#define VEC __m128i
+#define V(op) _mm_##op
+#define TPL(name) name##_sse2
+#define TARGET __attribute__((target("sse2")))
+#include "jpegcolour_simd.h"
+#undef VEC
+#undef V
+#undef TPL
+#undef TARGET
+
+#define VEC __m256i
+#define V(op) _mm256_##op
+#define TPL(name) name##_avx2
+#define TARGET __attribute__((target("avx2")))
+#include "jpegcolour_simd.h"
+#undef VEC
+#undef V
+#undef TPL
+#undef TARGET
+
+/* whole vectors here, the rest with the next engine down */
+#define ROWS(name, output, isa, vec, lower) \
+__attribute__((target(#isa))) \
+static void name##_##isa##_h1(const uint8_t *y, const uint8_t *cb, \
+	const uint8_t *cr, uint8_t *out, unsigned n, uint8_t alpha) \
+{ \
+	unsigned m = n & ~(unsigned)(sizeof(vec) - 1); \
+\
+	ycc_row_##isa(y, cb, cr, out, m, alpha, 0, output); \
+	if (m < n) \
+		lower.row[output][0](y + m, cb + m, cr + m, \
+			out + m * JPEGCOLOUR_PIXEL_SIZE(output), n - m, alpha); \
+} \
+__attribute__((target(#isa))) \
+static void name##_##isa##_h2(const uint8_t *y, const uint8_t *cb, \
+	const uint8_t *cr, uint8_t *out, unsigned n, uint8_t alpha) \
+{ \
+	unsigned m = n & ~(unsigned)(sizeof(vec) - 1); \
+\
+	ycc_row_##isa(y, cb, cr, out, m, alpha, 1, output); \
+	if (m < n) \
+		lower.row[output][1](y + m, cb + m/2, cr + m/2, \
+			out + m * JPEGCOLOUR_PIXEL_SIZE(output), n - m, alpha); \
+} \
+__attribute__((target(#isa))) \
+static void name##_##isa##_grey(const uint8_t *y, const uint8_t *cb, \
+	const uint8_t *cr, uint8_t *out, unsigned n, uint8_t alpha) \
+{ \
+	unsigned m = n & ~(unsigned)(sizeof(vec) - 1); \
+\
+	grey_row_##isa(y, out, m, alpha, output); \
+	if (m < n) \
+		lower.row[output][2](y + m, cb, cr, \
+			out + m * JPEGCOLOUR_PIXEL_SIZE(output), n - m, alpha); \
+}
+
+ROWS(bgr, JPEGDECODER_OUTPUT_BGR, sse2, __m128i, JPEGColour_scalar)
+ROWS(rgb, JPEGDECODER_OUTPUT_RGB, sse2, __m128i, JPEGColour_scalar)
+ROWS(bgra, JPEGDECODER_OUTPUT_BGRA, sse2, __m128i, JPEGColour_scalar)
+ROWS(rgba, JPEGDECODER_OUTPUT_RGBA, sse2, __m128i, JPEGColour_scalar)
+ROWS(rgb565, JPEGDECODER_OUTPUT_RGB565, sse2, __m128i, JPEGColour_scalar)
+
+ROWS(bgr, JPEGDECODER_OUTPUT_BGR, avx2, __m256i, JPEGColour_sse2)
+ROWS(rgb, JPEGDECODER_OUTPUT_RGB, avx2, __m256i, JPEGColour_sse2)
+ROWS(bgra, JPEGDECODER_OUTPUT_BGRA, avx2, __m256i, JPEGColour_sse2)
+ROWS(rgba, JPEGDECODER_OUTPUT_RGBA, avx2, __m256i, JPEGColour_sse2)
+ROWS(rgb565, JPEGDECODER_OUTPUT_RGB565, avx2, __m256i, JPEGColour_sse2)
+
+const JPEGColourEngine JPEGColour_sse2 = { "sse2", {
+	{ bgr_sse2_h1, bgr_sse2_h2, bgr_sse2_grey },
+	{ NULL, NULL, NULL }, /* I420 */
+	{ NULL, NULL, NULL }, /* NV12 */
+	{ rgb_sse2_h1, rgb_sse2_h2, rgb_sse2_grey },
+	{ bgra_sse2_h1, bgra_sse2_h2, bgra_sse2_grey },
+	{ rgba_sse2_h1, rgba_sse2_h2, rgba_sse2_grey },
+	{ rgb565_sse2_h1, rgb565_sse2_h2, rgb565_sse2_grey }
+} };
+
+const JPEGColourEngine JPEGColour_avx2 = { "avx2", {
+	{ bgr_avx2_h1, bgr_avx2_h2, bgr_avx2_grey },
+	{ NULL, NULL, NULL }, /* I420 */
+	{ NULL, NULL, NULL }, /* NV12 */
+	{ rgb_avx2_h1, rgb_avx2_h2, rgb_avx2_grey },
+	{ bgra_avx2_h1, bgra_avx2_h2, bgra_avx2_grey },
+	{ rgba_avx2_h1, rgba_avx2_h2, rgba_avx2_grey },
+	{ rgb565_avx2_h1, rgb565_avx2_h2, rgb565_avx2_grey }
+} };
+
+#endif
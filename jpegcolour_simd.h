@@ -0,0 +1,94 @@
+/*
+SIMD YCbCr -> BGR row kernel, included by jpegcolour_simd.c once per
+instruction set with these defined :
+
+	VEC          vector type
+	V(op)        intrinsic name, e.g. V(add_epi16) -> _mm_add_epi16
+	TPL(name)    function name with the instruction set suffix
+	TARGET       function attribute enabling the instruction set
+
+and TPL(load), TPL(load_dup) and TPL(store) already defined. Each vector of
+bytes is one step of pixels; the arithmetic is done on int16 halves of it.
+*/
+
+/* pair of 16-bit multipliers for madd : a*c0 + b*c1 on unpacked (a,b) */
+#define PAIR(c0, c1) V(set1_epi32)((int)(((uint32_t)(c1) << 16) | ((c0) & 0xffff)))
+
+/* descale the madd of interleaved (cb,cr) with (c0,c1) back to int16 */
+#define TERM(c0, c1) V(packs_epi32)( \
+	V(srai_epi32)(V(add_epi32)(V(madd_epi16)(lo, PAIR(c0, c1)), half), YCC_SCALEBITS), \
+	V(srai_epi32)(V(add_epi32)(V(madd_epi16)(hi, PAIR(c0, c1)), half), YCC_SCALEBITS))
+
+/* y as int16, cb and cr as int16 centred on 0. Multipliers above 1 have
+	their integer part applied as adds so the rest fits a signed 16-bit madd;
+	the sums are the same as the scalar code's, so are the results */
+static inline __attribute__((always_inline)) TARGET void TPL(ycc_bgr16)(
+	VEC y, VEC cb, VEC cr, VEC *b, VEC *g, VEC *r)
+{
+	VEC lo, hi, half;
+
+	half = V(set1_epi32)(YCC_ONE_HALF);
+	lo = V(unpacklo_epi16)(cb, cr);
+	hi = V(unpackhi_epi16)(cb, cr);
+
+	*b = V(add_epi16)(V(add_epi16)(y, V(add_epi16)(cb, cb)),
+		TERM(YCC_FIX(1.77200) - (2 << YCC_SCALEBITS), 0));
+	*g = V(sub_epi16)(V(add_epi16)(y,
+		TERM(-YCC_FIX(0.34414), (1 << YCC_SCALEBITS) - YCC_FIX(0.71414))), cr);
+	*r = V(add_epi16)(V(add_epi16)(y, cr),
+		TERM(0, YCC_FIX(1.40200) - (1 << YCC_SCALEBITS)));
+}
+
+#undef TERM
+#undef PAIR
+
+/* 'n' a multiple of the vector size; h2 selects half-width chroma */
+static inline __attribute__((always_inline)) TARGET void TPL(ycc_row)(
+	const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out,
+	unsigned n, uint8_t alpha, const int h2, const JPEGDecoder_Output output)
+{
+	const unsigned step = sizeof(VEC), cstep = h2 ? step/2 : step;
+	const unsigned out_step = step * JPEGCOLOUR_PIXEL_SIZE(output);
+	VEC zero, centre, a, yv, cbv, crv;
+	VEC blo, glo, rlo, bhi, ghi, rhi;
+
+	zero = V(set1_epi8)(0);
+	centre = V(set1_epi16)(128);
+	a = V(set1_epi8)((char)alpha);
+
+	for (; n; n -= step, y += step, cb += cstep, cr += cstep, out += out_step) {
+		yv = TPL(load)(y);
+		cbv = h2 ? TPL(load_dup)(cb) : TPL(load)(cb);
+		crv = h2 ? TPL(load_dup)(cr) : TPL(load)(cr);
+
+		TPL(ycc_bgr16)(V(unpacklo_epi8)(yv, zero),
+			V(sub_epi16)(V(unpacklo_epi8)(cbv, zero), centre),
+			V(sub_epi16)(V(unpacklo_epi8)(crv, zero), centre),
+			&blo, &glo, &rlo);
+		TPL(ycc_bgr16)(V(unpackhi_epi8)(yv, zero),
+			V(sub_epi16)(V(unpackhi_epi8)(cbv, zero), centre),
+			V(sub_epi16)(V(unpackhi_epi8)(crv, zero), centre),
+			&bhi, &ghi, &rhi);
+
+		TPL(store)(out, V(packus_epi16)(blo, bhi), V(packus_epi16)(glo, ghi),
+			V(packus_epi16)(rlo, rhi), a, output);
+	}
+}
+
+/* greyscale, 'n' a multiple of the vector size : each sample as it is in
+	every colour channel */
+static inline __attribute__((always_inline)) TARGET void TPL(grey_row)(
+	const uint8_t *y, uint8_t *out, unsigned n, uint8_t alpha,
+	const JPEGDecoder_Output output)
+{
+	const unsigned step = sizeof(VEC);
+	const unsigned out_step = step * JPEGCOLOUR_PIXEL_SIZE(output);
+	VEC a, yv;
+
+	a = V(set1_epi8)((char)alpha);
+
+	for (; n; n -= step, y += step, out += out_step) {
+		yv = TPL(load)(y);
+		TPL(store)(out, yv, yv, yv, a, output);
+	}
+}
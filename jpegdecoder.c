@@ -2,8 +2,6 @@
 #define _GNU_SOURCE
 
 #define BENCHMARK
-#define USE_FAST_IDCT
-/*#define USE_SLOW_IDCT*/
 
 #include <features.h>
 #include <stdio.h>
@@ -13,22 +11,110 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <math.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #ifdef BENCHMARK
 	#include <sys/time.h>
 #endif
 
 #include "image.h"
-
-/*#define DEBUG_BOUNDS_CHECK*/
+#include "jpegdecoder.h"
+#include "jpegidct.h"
+#include "jpegcolour.h"
 
 typedef struct JPEGComponent_t {
 	unsigned sub_x, sub_y, qt, ht;
+	/* each 8x8 block is reconstructed as block_size x block_size samples,
+		through 'idct' */
+	unsigned block_size;
+	void (*idct)(const JPEGIDCTBlock *blocks, unsigned n);
 } JPEGComponent;
 
+/* number of bits looked up in one step by the first-level Huffman table, codes
+	longer than this go through the canonical (maxcode) slow path */
+#define HUFF_LOOKAHEAD 9
+
+typedef struct JPEGHuffman_t {
+	/* first level, indexed by the next HUFF_LOOKAHEAD bits of the stream: code
+		length (0 if the code is longer than HUFF_LOOKAHEAD) and symbol */
+	uint8_t look_bits[1 << HUFF_LOOKAHEAD];
+	uint8_t look_sym[1 << HUFF_LOOKAHEAD];
+	/* AC symbols whose code and value bits both fit in the lookahead, decoded in
+		one step : value<<8 | run<<4 | (code + value bits), 0 if not possible */
+	int16_t fast_ac[1 << HUFF_LOOKAHEAD];
+	/* slow path : largest code of each length (-1 if none) and offset from a
+		code of that length to its index in values[] */
+	int32_t maxcode[18];
+	int32_t valoffset[17];
+	uint8_t values[256];
+} JPEGHuffman;
+
+/* entropy coded data is read through a 64-bit buffer, MSB first, which is
+	refilled several bytes at a time */
+typedef struct JPEGBitReader_t {
+	const uint8_t *in, *end;
+	uint64_t bits;
+	unsigned count;
+	unsigned pad; /* zero bytes shifted in at a marker or past 'end' */
+} JPEGBitReader;
+
+/* decoder state at the start of an MCU, decoding can resume from here
+	without looking at anything before it */
+typedef struct JPEGCheckpoint_t {
+	unsigned mcu;
+	JPEGBitReader b;
+	int dc[3];
+} JPEGCheckpoint;
+
+/* a checkpoint with the reader's position as an offset into the scan, so
+	that it holds for any copy of the file */
+typedef struct JPEGIndexEntry_t {
+	unsigned mcu;
+	uint64_t offset, bits;
+	unsigned count, pad;
+	int dc[3];
+} JPEGIndexEntry;
+
+struct JPEGIndex_t {
+	/* the scan it belongs to : mcu_x x mcu_y MCUs with a restart every
+		restart_interval of them, 'scan_size' bytes from its start to the end
+		of the file, the first of which hash to 'scan_hash' */
+	unsigned mcu_x, mcu_y, restart_interval;
+	uint64_t scan_size;
+	uint32_t scan_hash;
+	/* an entry every 'interval' MCUs, in order */
+	unsigned interval;
+	JPEGIndexEntry *entry;
+	unsigned count, size;
+};
+
+/* scratch buffers which a decode allocates as it needs them */
+typedef enum JPEGScratch_t {
+	JPEGSCRATCH_STRIP, /* one MCU row of pixels, decoding in strips */
+	JPEGSCRATCH_RING, /* the pipeline's rows of coefficients */
+	JPEGSCRATCH_RING_SUPPORT, /* and the support of each of their blocks */
+	JPEGSCRATCH_RING_BUSY,
+	JPEGSCRATCH_COUNT
+} JPEGScratch;
+
+/* allocations kept from one decode to the next, only ever grown */
+struct JPEGContext_t {
+	/* pixels of the image decoded last time, while it still has them */
+	uint8_t *output;
+	size_t output_size;
+	void *scratch[JPEGSCRATCH_COUNT];
+	size_t scratch_size[JPEGSCRATCH_COUNT];
+	/* the decoder's lists of restart intervals and checkpoints */
+	const uint8_t **restart;
+	unsigned restart_size;
+	JPEGCheckpoint *checkpoint;
+	unsigned checkpoint_size;
+};
+
 typedef enum JPEGDecoder_LogLevel_t
 {
 	JPEGDECODER_LOGLEVEL_DEBUG,
@@ -39,12 +125,73 @@ typedef enum JPEGDecoder_LogLevel_t
 } JPEGDecoder_LogLevel;
 
 typedef struct JPEGDecoder_t {
-	int qt[2][64];
-	uint8_t *ht[4], *pixel_data_start, *pixel_data_end;
-	uint8_t *in, *current_segment_start, *current_segment_end;
+	int qt[2][64]; /* natural order, as in the DQT */
+	/* what the entropy decoder multiplies coefficients by : the tables above,
+		or ones when the coefficients are output as they are in the file */
+	int16_t dequant[2][64];
+	const JPEGIDCTEngine *idct;
+	/* decoding at 1/scale size, blocks of luma become block_size across */
+	unsigned scale, block_size;
+	const JPEGColourEngine *colour;
+	/* Huffman tables by DHT class * 2 + id : shared ones from the cache, or
+		built here */
+	const JPEGHuffman *ht[4];
+	JPEGHuffman ht_built[4];
+	/* pixels are written here : the whole image, or with 'strip' one MCU row
+		which is reused for each row in turn */
+	uint8_t *pixel_data_start, *pixel_data_end;
+	int strip;
+	/* the output window : pixel (crop_x, crop_y) of the image is the first
+		one of the output, and MCU columns mcu_x0..mcu_x1-1 of rows
+		mcu_y0..mcu_y1-1 cover it.  The whole image unless cropping. */
+	int crop;
+	unsigned crop_x, crop_y, crop_width, crop_height;
+	unsigned mcu_x0, mcu_x1, mcu_y0, mcu_y1;
+	/* packed output : rows 'stride' bytes apart, nothing written at or past
+		(limit_x, limit_y) of the image */
+	JPEGDecoder_Output output;
+	uint8_t alpha;
+	unsigned pixel_size;
+	size_t stride;
+	unsigned limit_x, limit_y;
+	JPEGDecoder_BufferCallback buffer;
+	void *buffer_user;
+	JPEGDecoder_RowsCallback rows;
+	void *rows_user;
+	/* entropy coded data of the scan, as in the file */
+	const uint8_t *scan_start, *scan_end;
+	const uint8_t *in, *current_segment_start, *current_segment_end;
 	unsigned current_segment_size;
 	unsigned width, height, components;
 	unsigned mcu_x, mcu_y, mcu_size_x, mcu_size_y;
+	unsigned blocks_per_mcu;
+	int csm[3][2]; /* sample replication of each component within an MCU */
+	/* colour conversion of a row for the scan's sampling layout, NULL if it
+		goes through JPEGColour_row */
+	JPEGColourRow colour_row;
+	/* restart intervals : MCUs per interval (0 if no DRI) and, when threads
+		need them as entry points, where each interval starts */
+	unsigned restart_interval;
+	const uint8_t **restart;
+	unsigned restart_count, restart_size;
+	/* independent entry points into the scan, shared out between threads */
+	JPEGCheckpoint *checkpoint;
+	unsigned checkpoint_count, checkpoint_size;
+	unsigned checkpoint_next; /* next one for a worker to claim */
+	/* entry points from a seek index of the file, or an index being built
+		instead of decoding */
+	const JPEGIndex *index;
+	JPEGIndex *index_build;
+	/* decoding to coefficients rather than pixels */
+	JPEGCoefficients *coefficients;
+	int dequantise;
+	unsigned threads;
+	int decoded; /* a scan was set up and decoded */
+	int bad_tables; /* a DHT was rejected, so no scan can be trusted */
+	int pipeline_mode;
+	struct JPEGPipeline_t *pipeline;
+	/* if set, memory is taken from and left in here rather than freed */
+	JPEGContext *context;
 	JPEGDecoder_LogLevel log_level;
 	JPEGComponent component[3];
 	Image *image;
@@ -65,29 +212,206 @@ static void JPEGDecoder_log(JPEGDecoder *j
 	}
 }
 
+static const char zigzag_order[64] = {
+	0, 1, 5, 6,14,15,27,28,
+	2, 4, 7,13,16,26,29,42,
+	3, 8,12,17,25,30,41,43,
+	9,11,18,24,31,40,44,53,
+	10,19,23,32,39,45,52,54,
+	20,22,33,38,46,51,55,60,
+	21,34,37,47,50,56,59,61,
+	35,36,48,49,57,58,62,63
+};
+
+/* natural position of each zig-zag one */
+static const uint8_t natural_order[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10,
+	17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* for each zig-zag position, bit max(row, column) : OR'd together over the
+	nonzero coefficients they give the size of the block's support */
+static const uint8_t zigzag_support[64] = {
+	1, 2, 2, 4, 2, 4, 8, 4,
+	4, 8, 16, 8, 4, 8, 16, 32,
+	16, 8, 8, 16, 32, 64, 32, 16,
+	8, 16, 32, 64, 128, 64, 32, 16,
+	16, 32, 64, 128, 128, 64, 32, 16,
+	32, 64, 128, 128, 64, 32, 32, 64,
+	128, 128, 64, 32, 64, 128, 128, 64,
+	64, 128, 128, 64, 128, 128, 128, 128
+};
+
+/* FNV-1a */
+static uint32_t hash_bytes(const uint8_t *in, size_t size)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; size; size--, in++)
+		hash = (hash ^ *in) * 16777619u;
+
+	return hash;
+}
+
 static void dezigzag_int_int(const int *in, int *out)
 {
-	static const char zigzag_order[64] = {
-		0, 1, 5, 6,14,15,27,28,
-		2, 4, 7,13,16,26,29,42,
-		3, 8,12,17,25,30,41,43,
-		9,11,18,24,31,40,44,53,
-		10,19,23,32,39,45,52,54,
-		20,22,33,38,46,51,55,60,
-		21,34,37,47,50,56,59,61,
-		35,36,48,49,57,58,62,63
-	};
 	int i;
 	for (i = 0; i<64; i++) {
 		out[i] = in[(int)zigzag_order[i]];
 	}
 }
 
-static int clamp_int(int x, int min, int max)
+
+/* 'size' bytes for the image to be decoded into.  A context reuses the
+	pixels it allocated for the same image last time if they are enough. */
+static uint8_t *output_alloc(JPEGDecoder *j, size_t size)
+{
+	JPEGContext *context = j->context;
+
+	if (!context)
+		return (uint8_t *)malloc(size);
+
+	if (context->output && size <= context->output_size)
+		return context->output;
+
+	free(context->output);
+	context->output = (uint8_t *)malloc(size);
+	context->output_size = context->output ? size : 0;
+	return context->output;
+}
+
+/* a scratch buffer of 'size' bytes, to be given back with scratch_free.  A
+	context keeps it for the next decode, growing it when more is needed. */
+static void *scratch_alloc(JPEGDecoder *j, JPEGScratch slot, size_t size)
+{
+	JPEGContext *context = j->context;
+
+	if (!context)
+		return malloc(size);
+
+	if (size > context->scratch_size[slot]) {
+		free(context->scratch[slot]);
+		context->scratch[slot] = malloc(size);
+		context->scratch_size[slot] = context->scratch[slot] ? size : 0;
+	}
+	return context->scratch[slot];
+}
+
+static void scratch_free(JPEGDecoder *j, void *p)
+{
+	if (!j->context)
+		free(p);
+}
+
+/* no colour conversion : each component gets a plane of its own at its own
+	resolution, except that Cb and Cr share one for NV12 */
+static void construct_planes(JPEGDecoder *j)
+{
+	Image *image = j->image;
+	Image_Plane *plane = image->plane;
+	unsigned i, max_x, max_y;
+	size_t size[3], total = 0;
+	uint8_t *data;
+
+	Image_construct(image);
+
+	max_x = j->mcu_size_x / j->block_size;
+	max_y = j->mcu_size_y / j->block_size;
+
+	if (j->output == JPEGDECODER_OUTPUT_NV12 && (j->components != 3
+		|| j->component[1].sub_x != j->component[2].sub_x
+		|| j->component[1].sub_y != j->component[2].sub_y)
+	) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"NV12 needs Cb and Cr sampled alike\n");
+		return;
+	}
+
+	for (i = 0; i < j->components; i++) {
+		plane[i].size_x = (j->width * j->component[i].sub_x + max_x - 1) / max_x;
+		plane[i].size_y = (j->height * j->component[i].sub_y + max_y - 1) / max_y;
+		plane[i].stride = j->mcu_x * j->component[i].sub_x * j->block_size;
+		plane[i].step = 1;
+		size[i] = plane[i].stride * j->mcu_y * j->component[i].sub_y * j->block_size;
+		total += size[i];
+	}
+
+	data = output_alloc(j, total);
+	if (!data) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL, "cannot allocate planes\n");
+		return;
+	}
+
+	plane[0].data = data;
+	for (i = 1; i < j->components; i++)
+		plane[i].data = plane[i - 1].data + size[i - 1];
+
+	if (j->output == JPEGDECODER_OUTPUT_NV12) {
+		plane[1].stride = plane[2].stride = plane[1].stride * 2;
+		plane[2].data = plane[1].data + 1;
+		plane[1].step = plane[2].step = 2;
+	}
+
+	image->data = data;
+	image->size_x = j->width;
+	image->size_y = j->height;
+	image->total_x = j->mcu_x * j->mcu_size_x;
+	image->total_y = j->mcu_y * j->mcu_size_y;
+	image->channels = j->components;
+	image->planes = j->components;
+
+	j->pixel_data_start = data;
+	j->pixel_data_end = data + total;
+}
+
+/* coefficients instead of pixels : a block for every one in the scan */
+static void construct_coefficients(JPEGDecoder *j)
 {
-	if (x < min) { return min; }
-	if (x > max) { return max; }
-	return x;
+	JPEGCoefficients *c = j->coefficients;
+	JPEGCoefficients_Component *component;
+	size_t size[3], total = 0;
+	unsigned i;
+
+	JPEGCoefficients_destruct(c);
+
+	Image_construct(j->image);
+	j->image->size_x = j->width;
+	j->image->size_y = j->height;
+	j->image->total_x = j->mcu_x * j->mcu_size_x;
+	j->image->total_y = j->mcu_y * j->mcu_size_y;
+	j->image->channels = j->components;
+
+	c->width = j->width;
+	c->height = j->height;
+	c->components = j->components;
+	c->dequantised = j->dequantise;
+
+	for (i = 0; i < j->components; i++) {
+		component = &c->component[i];
+		component->sub_x = j->component[i].sub_x;
+		component->sub_y = j->component[i].sub_y;
+		component->blocks_x = j->mcu_x * component->sub_x;
+		component->blocks_y = j->mcu_y * component->sub_y;
+		size[i] = (size_t)component->blocks_x * component->blocks_y * 64;
+		total += size[i];
+	}
+
+	c->data = (int16_t *)calloc(total, sizeof *c->data);
+	if (!c->data) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"cannot allocate coefficients\n");
+		return;
+	}
+
+	c->component[0].coef = c->data;
+	for (i = 1; i < j->components; i++)
+		c->component[i].coef = c->component[i - 1].coef + size[i - 1];
 }
 
 static void parse_sof(JPEGDecoder *j)
@@ -100,21 +424,30 @@ static void parse_sof(JPEGDecoder *j)
 	if (j->current_segment_size < 11) {
 		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
 			"invalid SOF0 size (%d)\n", j->current_segment_size);
+		return;
 	}
 
-	j->components = nc = j->in[7];
+	nc = j->in[7];
 	j->height = 256*j->in[3] + j->in[4];
 	j->width = 256*j->in[5] + j->in[6];
 
 	JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
 	 	"image size : %u x %u\n", j->width, j->height);
 
+	if ((nc != 1 && nc != 3) || j->current_segment_size < 8 + 3*nc) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"unsupported number of components (%u)\n", nc);
+		return;
+	}
+	j->components = nc;
+
 	for (i = 0; i < nc; i++) {
 		ci = j->in[8 + i*3] - 1;
 		if (ci > 2)	{
 			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
 				"SOF0 component descriptor %d specifies invalid index (%u)\n",
 				i, ci);
+			return;
 		}
 		j->component[ci].sub_x = j->in[9 + i*3]>>4;
 		j->component[ci].sub_y = j->in[9 + i*3]&15;
@@ -131,65 +464,139 @@ static void parse_sof(JPEGDecoder *j)
 		);
 	}
 
-	if (j->components == 3)	{
-		if (j->component[0].sub_x > 1
-			|| j->component[1].sub_x > 1
-			|| j->component[2].sub_x > 1
-		) {
+	/* the scan of a single component has one block per MCU, whatever its
+		sampling factors say */
+	if (nc == 1)
+		j->component[0].sub_x = j->component[0].sub_y = 1;
+
+	j->mcu_size_x = j->mcu_size_y = 8;
+	for (i = 0; i < nc; i++) {
+		if (j->component[i].sub_x > 1)
 			j->mcu_size_x = 16;
-		} else {
-			j->mcu_size_x = 8;
-		}
-		if (j->component[0].sub_y > 1
-			|| j->component[1].sub_y > 1
-			|| j->component[2].sub_y > 1
-		) {
+		if (j->component[i].sub_y > 1)
 			j->mcu_size_y = 16;
-		} else {
-			j->mcu_size_y = 8;
-		}
 	}
 
 	j->mcu_x =
 		(j->width / j->mcu_size_x) + ( j->width % j->mcu_size_x == 0 ? 0 : 1);
 	j->mcu_y =
-		(j->height / j->mcu_size_y) + ( j->height % j->mcu_size_y == 3 ? 0 : 1);
+		(j->height / j->mcu_size_y) + ( j->height % j->mcu_size_y == 0 ? 0 : 1);
+
+	/* scaled decoding : every 8x8 block becomes block_size x block_size
+		samples, from here on sizes are those of the output */
+	j->mcu_size_x = j->mcu_size_x * j->block_size / 8;
+	j->mcu_size_y = j->mcu_size_y * j->block_size / 8;
+	j->width = (j->width + j->scale - 1) / j->scale;
+	j->height = (j->height + j->scale - 1) / j->scale;
 
 	JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
 		"SOF: mcus[%u:%u] mcusize[%u:%u] total size[%u:%u]\n",
 		j->mcu_x, j->mcu_y, j->mcu_size_x, j->mcu_size_y,
 		j->mcu_x*j->mcu_size_x, j->mcu_y*j->mcu_size_y);
 
-	pixel_data_size =
-		j->mcu_x * j->mcu_y * j->mcu_size_x * j->mcu_size_y * j->components;
+	/* indexing only needs the geometry */
+	if (j->index_build)
+		return;
 
-	Image_destruct(j->image);
-	Image_construct_size_total_channels(j->image,
-		j->width, j->height,
-		j->mcu_x * j->mcu_size_x, j->mcu_y * j->mcu_size_y,
-		j->components
-	);
+	/* a context hangs on to the image's pixels for output_alloc */
+	if (!j->context || j->image->data != j->context->output)
+		Image_destruct(j->image);
 
-	j->pixel_data_start = j->image->data;
-	j->pixel_data_end = j->image->data + pixel_data_size;
-}
+	/* from here on the image is the crop */
+	if (j->crop) {
+		if (j->crop_x >= j->width || j->crop_y >= j->height) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+				"crop at %u,%u outside the %ux%u image\n",
+				j->crop_x, j->crop_y, j->width, j->height);
+			return;
+		}
+		j->width = j->width - j->crop_x < j->crop_width
+			? j->width - j->crop_x : j->crop_width;
+		j->height = j->height - j->crop_y < j->crop_height
+			? j->height - j->crop_y : j->crop_height;
+	}
+
+	j->mcu_x0 = j->crop_x / j->mcu_size_x;
+	j->mcu_y0 = j->crop_y / j->mcu_size_y;
+	j->mcu_x1 = (j->crop_x + j->width + j->mcu_size_x - 1) / j->mcu_size_x;
+	j->mcu_y1 = (j->crop_y + j->height + j->mcu_size_y - 1) / j->mcu_size_y;
+
+	if (j->coefficients) {
+		construct_coefficients(j);
+		return;
+	}
+
+	if (j->output == JPEGDECODER_OUTPUT_I420
+		|| j->output == JPEGDECODER_OUTPUT_NV12
+	) {
+		construct_planes(j);
+		return;
+	}
 
-#ifdef USE_FAST_IDCT
-static void scale_qt_for_fast_idct(int *qt) {
-	uint_fast8_t x, y;
-	static const float scale_factor[8] = {
-		1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
-    1.0f, 0.785694958f, 0.541196100f, 0.275899379f
-	};
+	/* packed pixels, with rows padded out to whole MCUs unless the caller
+		says where they go or only a crop is wanted */
+	j->pixel_size = JPEGCOLOUR_PIXEL_SIZE(j->output);
+	if (j->buffer || j->crop) {
+		j->limit_x = j->crop_x + j->width;
+		j->limit_y = j->crop_y + j->height;
+	} else {
+		j->limit_x = j->mcu_x * j->mcu_size_x;
+		j->limit_y = j->mcu_y * j->mcu_size_y;
+	}
+	j->stride = (j->limit_x - j->crop_x) * j->pixel_size;
+
+	if (j->buffer || j->strip) {
+		/* the image only describes the geometry */
+		Image_construct(j->image);
+		j->image->size_x = j->width;
+		j->image->size_y = j->height;
+		j->image->total_x = j->limit_x - j->crop_x;
+		j->image->total_y = j->limit_y - j->crop_y;
+		j->image->channels = j->pixel_size;
+	}
 
-	for (y=0; y<8; y++) {
-		for (x=0; x<8; x++) {
-			*qt *= scale_factor[x] * scale_factor[y];
-			qt++;
+	if (j->buffer) {
+		j->stride = 0;
+		j->pixel_data_start = j->buffer(j->buffer_user, j->width, j->height,
+			&j->stride);
+		if (j->pixel_data_start && j->stride < j->width * j->pixel_size) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+				"output rows of %u bytes too short\n", (unsigned)j->stride);
+			j->pixel_data_start = NULL;
 		}
+		j->pixel_data_end = j->pixel_data_start ? j->pixel_data_start
+			+ (j->height - 1) * j->stride + j->width * j->pixel_size : NULL;
+		return;
+	}
+
+	if (j->strip) {
+		/* the pixels go through a buffer of one MCU row */
+		pixel_data_size = j->stride * j->mcu_size_y;
+		scratch_free(j, j->pixel_data_start);
+		j->pixel_data_start = (uint8_t *)scratch_alloc(j, JPEGSCRATCH_STRIP,
+			pixel_data_size);
+		j->pixel_data_end = j->pixel_data_start
+			? j->pixel_data_start + pixel_data_size : NULL;
+		return;
+	}
+
+	pixel_data_size = j->stride * (j->limit_y - j->crop_y);
+
+	Image_construct(j->image);
+	j->image->data = output_alloc(j, pixel_data_size);
+	if (!j->image->data) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL, "cannot allocate image\n");
+		return;
 	}
+	j->image->size_x = j->width;
+	j->image->size_y = j->height;
+	j->image->total_x = j->limit_x - j->crop_x;
+	j->image->total_y = j->limit_y - j->crop_y;
+	j->image->channels = j->pixel_size;
+
+	j->pixel_data_start = j->image->data;
+	j->pixel_data_end = j->image->data + pixel_data_size;
 }
-#endif
 
 /* read quantisation tables (QT) from DQT segment */
 static void parse_dqt(JPEGDecoder *j)
@@ -223,303 +630,255 @@ static void parse_dqt(JPEGDecoder *j)
 
 		/* de-zigzag into the final QT array */
 		dezigzag_int_int(qt_temp, j->qt[qt_index]);
-
-#ifdef USE_FAST_IDCT
-		/* if we're using the fast IDCT, we should prescale */
-		scale_qt_for_fast_idct(j->qt[qt_index]);
-#endif
 	}
 }
 
-#ifdef USE_SLOW_IDCT
-/*
-Inverse DCT with level shift to put output values back to original 0-255
-range.  This is the naive algorithm which is the slowest.
-*/
-static void IDCT(const int *input, uint8_t *output, const int *qt)
-{
-	int u, v; /* input coords */
-	int x, y; /* output coords */
-	int iv; /* input value */
-	float ku, kv; /* input scaling values for DC terms */
-	float sum; /* sum of terms for specific output coord */
-
-	/* for each row in the output */
-	for (y=0; y<8; y++) {
-		/* for each column in the output */
-		for (x=0; x<8; x++) {
-			sum = 0.0f;
-			/* for each row in the input */
-			for (v=0; v<8; v++)	{
-				/* for each column in the input */
-				for (u=0; u<8; u++)	{
-					/* get DC scaling coefficient */
-					ku = u ? 1.0f : 1.0f / sqrt(2.0f);
-					kv = v ? 1.0f : 1.0f / sqrt(2.0f);
-
-					/* add DCT component if there is a value in the input,
-					   otherwise sum will not be changed and we wasted cycles
-					   doing expensive cosine and mult. */
-					if (iv = input[u+v*8]) {
-						sum += ku * kv * iv * qt[u+v*8]
-							* cos((float)(2*x+1) * (float)u * pi/16.0f)
-							* cos((float)(2*y+1) * (float)v * pi/16.0f);
-					}
-				}
-			}
-
-			/* input is -512 to 512. output is Y/Cb/Cr values 0-255 */
-			output[x+y*16] = clamp_int(round(sum*0.25+128), 0, 255);
-		}
-	}
+static uint64_t load_be64(const uint8_t *p)
+{
+	return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48
+		| (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32
+		| (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16
+		| (uint64_t)p[6] << 8 | (uint64_t)p[7];
 }
-#endif
 
-#ifdef USE_FAST_IDCT
+static void bitreader_init(JPEGBitReader *b, const uint8_t *in,
+	const uint8_t *end)
+{
+	b->in = in;
+	b->end = end;
+	b->bits = 0;
+	b->count = 0;
+	b->pad = 0;
+}
 
-int DESCALE(int x, int y)
+/* nonzero if any of the 8 bytes is 0xff */
+static int has_ff_byte(uint64_t w)
 {
-	return x >> y;
+	return ((~w - 0x0101010101010101ULL) & w & 0x8080808080808080ULL) != 0;
 }
 
-static int IDCT_fast_out(int x)
+/* top up the bit buffer to at least 56 bits, from data which still has its
+	byte stuffing : 0xff 0x00 stands for 0xff, and 0xff followed by anything
+	else is a marker, where the data ends as far as the reader is concerned
+	and zeros are shifted in instead, as they are past 'end'.
+
+	When the next 8 bytes hold no 0xff they are loaded all at once and we only
+	advance past the whole bytes that fitted; the bits below 'count' then
+	already hold the following bytes, which the next load ORs in again at the
+	same position.  Otherwise it goes a byte at a time. */
+static void bitreader_refill(JPEGBitReader *b)
 {
-	x /= 8;
-	x+=128;
-	if (x < 0) { return 0; }
-	if (x > 255) { return 255; }
-	return x;
+	uint64_t w;
+	unsigned c;
+
+	if (b->end - b->in >= 8) {
+		w = load_be64(b->in);
+		if (!has_ff_byte(w)) {
+			b->bits |= w >> b->count;
+			b->in += (63 - b->count) >> 3;
+			b->count |= 56;
+			return;
+		}
+	}
+
+	while (b->count <= 56) {
+		if (b->in < b->end && b->in[0] != 0xff) {
+			c = *b->in++;
+		} else if (b->end - b->in >= 2 && b->in[1] == 0) {
+			c = 0xff;
+			b->in += 2;
+		} else {
+			c = 0;
+			b->pad++;
+		}
+		b->bits |= (uint64_t)c << (56 - b->count);
+		b->count += 8;
+	}
 }
 
-static void IDCT(const int *input, uint8_t *output, const int *qt)
+/* at the end of a restart interval : drop what is left in the buffer and move
+	on past the next RSTn marker, 0 if another marker or the end comes first */
+static int bitreader_restart(JPEGBitReader *b)
 {
-	const int *i;
-	uint8_t *o;
-	uint_fast8_t x, y;
-	float ws[64], *wsptr, dcval;
-	float t0, t1, t2, t3, t4, t5, t6, t7, t10, t11, t12, t13;
-	float z5, z10, z11, z12, z13;
+	const uint8_t *in = b->in;
+
+	b->bits = 0;
+	b->count = 0;
+	b->pad = 0;
+
+	while ((in = (const uint8_t *)memchr(in, 0xff, b->end - in))
+		&& b->end - in >= 2) {
+		if (in[1] >= 0xd0 && in[1] <= 0xd7) {
+			b->in = in + 2;
+			return 1;
+		} else if (in[1] == 0) {
+			in += 2;
+		} else if (in[1] == 0xff) {
+			in++;
+		} else {
+			break;
+		}
+	}
 
-#define M_SQRT_2 (1.414213562f)
+	b->in = in ? in : b->end;
+	return 0;
+}
 
-	wsptr = ws;
-	i = input;
+static unsigned bitreader_peek(const JPEGBitReader *b, unsigned n)
+{
+	return (unsigned)(b->bits >> (64 - n));
+}
 
-	for (y = 0; y < 8; y++) {
-		if ((i[8]|i[16]|i[24]|i[32]|i[40]|i[48]|i[56]) == 0) {
-			dcval = i[0]*qt[0];
-			wsptr[0]  =	wsptr[8]  =	wsptr[16] =	wsptr[24] =
-			wsptr[32] =	wsptr[40] =	wsptr[48] =	wsptr[56] = dcval;
-			i++;
-			qt++;
-			wsptr++;
-			continue;
-		}
+static void bitreader_skip(JPEGBitReader *b, unsigned n)
+{
+	b->bits <<= n;
+	b->count -= n;
+}
 
-		t0 = i[0] *qt[0];
-		t1 = i[16]*qt[16];
-		t2 = i[32]*qt[32];
-		t3 = i[48]*qt[48];
-
-		t10 = t0 + t2;
-		t11 = t0 - t2;
-		t13 = t1 + t3;
-		t12 = (t1 - t3) * M_SQRT_2 - t13;
-		t0 = t10 + t13;
-		t3 = t10 - t13;
-		t1 = t11 + t12;
-		t2 = t11 - t12;
-
-		t4 = i[8] *qt[8];
-		t5 = i[24]*qt[24];
-		t6 = i[40]*qt[40];
-		t7 = i[56]*qt[56];
-		z13 = t6 + t5;
-		z10 = t6 - t5;
-		z11 = t4 + t7;
-		z12 = t4 - t7;
-		t7 = z11 + z13;
-		t11= (z11 - z13) * M_SQRT_2;
-
-		z5 = (z10 + z12) * 1.847759065f;
-		t10 = 1.082392200f * z12 - z5;
-		t12 = -2.613125930f * z10 + z5;
-
-		t6 = t12 - t7;
-		t5 = t11 - t6;
-		t4 = t10 + t5;
-
-		wsptr[0]  = t0 + t7;
-		wsptr[56] = t0 - t7;
-		wsptr[8]  = t1 + t6;
-		wsptr[48] = t1 - t6;
-		wsptr[16] = t2 + t5;
-		wsptr[40] = t2 - t5;
-		wsptr[32] = t3 + t4;
-		wsptr[24] = t3 - t4;
-		i++;
-		qt++;
-		wsptr++;
-	}
-
-	o = output;
-	wsptr = ws;
-
-	for (x=0; x < 8; x++) {
-		t10 = wsptr[0] + wsptr[4];
-		t11 = wsptr[0] - wsptr[4];
-
-		t13 = wsptr[2] + wsptr[6];
-		t12 =(wsptr[2] - wsptr[6]) * M_SQRT_2 - t13;
-		t0 = t10 + t13;
-		t3 = t10 - t13;
-		t1 = t11 + t12;
-		t2 = t11 - t12;
-
-		z13 = wsptr[5] + wsptr[3];
-		z10 = wsptr[5] - wsptr[3];
-		z11 = wsptr[1] + wsptr[7];
-		z12 = wsptr[1] - wsptr[7];
-
-		t7 = z11 + z13;
-		t11= (z11 - z13) * M_SQRT_2;
-
-		z5 = (z10 + z12) * 1.847759065f;
-		t10 = 1.082392200f * z12 - z5;
-		t12 = -2.613125930f * z10 + z5;
-
-		t6 = t12 - t7;
-		t5 = t11 - t6;
-		t4 = t10 + t5;
-
-		o[0] = IDCT_fast_out(t0 + t7);
-		o[7] = IDCT_fast_out(t0 - t7);
-		o[1] = IDCT_fast_out(t1 + t6);
-		o[6] = IDCT_fast_out(t1 - t6);
-		o[2] = IDCT_fast_out(t2 + t5);
-		o[5] = IDCT_fast_out(t2 - t5);
-		o[4] = IDCT_fast_out(t3 + t4);
-		o[3] = IDCT_fast_out(t3 - t4);
-
-		wsptr+=8;
-		o+=16;
-	}
+/* nonzero if bits from past 'end' have been consumed, i.e. the data ran out */
+static int bitreader_overrun(const JPEGBitReader *b)
+{
+	return b->count < b->pad * 8;
 }
-#endif
 
-static void get_huff_code(
-	const uint8_t *start
-	,unsigned bit
-	,const uint8_t *ht
-	,unsigned *sym
-	,unsigned *zero_count
-	,unsigned *huff_bits
-	,unsigned *value_bits
-	,int *value)
-{
-	const uint8_t *in;
-	unsigned hbytes, hti;
-
-	in = start + (bit>>3);
-	hbytes = 0x1000000*in[0] + 0x10000*in[1] + 0x100*in[2] + in[3];
-	hbytes <<= (bit & 7);
-	hti = (hbytes >> 15) & 0x1fffe;
-	*huff_bits = ht[hti];
-	*sym = ht[hti+1];
-	*zero_count = *sym >> 4;
-	*value_bits = *sym & 0xf;
-	if (*value_bits) {
-		*value =
-			(hbytes >> (32-*value_bits-*huff_bits)) & (~0U >> (32-*value_bits));
-	if (!(hbytes & (0x80000000 >> *huff_bits)))
-		*value = (*value | (0xffffffff << *value_bits))+1;
-	} else {
-		*value = 0;
-	}
+/* drop the padding from the bottom of the buffer, so that 'end' can be moved
+	further on once more data is available */
+static void bitreader_unpad(JPEGBitReader *b)
+{
+	if (!b->pad || bitreader_overrun(b))
+		return;
+	b->count -= b->pad * 8;
+	b->bits = b->count ? b->bits & ~(~(uint64_t)0 >> b->count) : 0;
+	b->pad = 0;
 }
 
-static void write_pixel(JPEGDecoder *j
-	,unsigned x, unsigned y
-	,unsigned r, unsigned g, unsigned b
-)
+/* read 'n' (1-16) bits and sign-extend them as a JPEG magnitude value */
+static int bitreader_receive_extend(JPEGBitReader *b, unsigned n)
 {
-	uint8_t *image;
+	int v = (int)bitreader_peek(b, n);
+	bitreader_skip(b, n);
+	if (v < (1 << (n - 1)))
+		v -= (1 << n) - 1;
+	return v;
+}
 
-#ifdef DEBUG_BOUNDS_CHECK
-	if (x >= j->mcu_x * j->mcu_size_x || y >= j->mcu_y * j->mcu_size_y) {
-		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
-			"write_pixel() out of bounds: (%u,%u)\n", x, y);
-		__asm__("int $3");
+/* decode one Huffman symbol, the caller guarantees at least 16 bits are in
+	the buffer */
+static unsigned huff_decode(JPEGBitReader *b, const JPEGHuffman *h)
+{
+	unsigned look, len;
+	int32_t code;
+
+	look = bitreader_peek(b, HUFF_LOOKAHEAD);
+	len = h->look_bits[look];
+	if (len) {
+		bitreader_skip(b, len);
+		return h->look_sym[look];
 	}
 
-	if (r > 255 || g > 255 || b > 255) {
-		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
-			"write_pixel() colour out of range: (%u,%u,%u)\n", r, g, b);
-		__asm__("int $3");
+	code = bitreader_peek(b, 16);
+	for (len = HUFF_LOOKAHEAD + 1; len <= 16; len++) {
+		if ((code >> (16 - len)) <= h->maxcode[len]) {
+			bitreader_skip(b, len);
+			return h->values[(h->valoffset[len] + (code >> (16 - len))) & 0xff];
+		}
 	}
-#endif
 
-	image = j->pixel_data_start + (y*j->mcu_size_x*j->mcu_x + x)*j->components;
+	/* invalid code, skip it and return an EOB */
+	bitreader_skip(b, 16);
+	return 0;
+}
 
-#ifdef DEBUG_BOUNDS_CHECK
-	if (image >= j->pixel_data_end) {
-		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
-			"write_pixel() calculated address out of array, but position within image\n");
-		__asm__("int $3");
+/* entropy decode one block, each coefficient going straight to its natural
+	position in 'coef' multiplied by 'qt'.  'coef' has to be all zeros, and
+	only the positions with a coefficient are written.  Returns the size of
+	the top left square they are all in : 1, 2, 4 or 8. */
+static unsigned do_mcu(
+	JPEGDecoder *j, const JPEGHuffman *ht_dc, const JPEGHuffman *ht_ac,
+	JPEGBitReader *b, int *dc, const int16_t *qt, int16_t *coef)
+{
+	unsigned sym, run, size, k, n, support = 1;
+	int fast;
+
+	if (b->count < 32)
+		bitreader_refill(b);
+
+	size = huff_decode(b, ht_dc) & 15;
+	if (size)
+		*dc += bitreader_receive_extend(b, size);
+	coef[0] = *dc * qt[0];
+
+	for (k = 1; k < 64; ) {
+		if (b->count < 32)
+			bitreader_refill(b);
+
+		/* common case : run, size and value straight from the first level */
+		fast = ht_ac->fast_ac[bitreader_peek(b, HUFF_LOOKAHEAD)];
+		if (fast) {
+			k += (fast >> 4) & 15;
+			bitreader_skip(b, fast & 15);
+			n = natural_order[k & 63];
+			coef[n] = (fast >> 8) * qt[n];
+			support |= zigzag_support[k & 63];
+			k++;
+			continue;
+		}
+
+		sym = huff_decode(b, ht_ac);
+		run = sym >> 4;
+		size = sym & 15;
+		if (!size) {
+			if (run != 15)
+				break; /* EOB */
+			k += 16; /* ZRL */
+			continue;
+		}
+		k += run;
+		n = natural_order[k & 63];
+		coef[n] = bitreader_receive_extend(b, size) * qt[n];
+		support |= zigzag_support[k & 63];
+		k++;
 	}
-#endif
 
-	image[0] = r;
-	image[1] = g;
-	image[2] = b;
+	return support < 2 ? 1 : support < 4 ? 2 : support < 16 ? 4 : 8;
 }
 
-static void do_mcu(
-	JPEGDecoder *j, const uint8_t *ht_dc, const uint8_t *ht_ac, const int *qt,
-	const uint8_t *start, int *curbit, int *dc, uint8_t *out)
+/* entropy decode one block without keeping the coefficients */
+static void skip_block(const JPEGHuffman *ht_dc, const JPEGHuffman *ht_ac,
+	JPEGBitReader *b, int *dc)
 {
-	unsigned sym, huff_bits, dcti = 0, zero_count, value_bits;
-	int value, dct[64], dct_dzz[64];
+	unsigned sym, size, k;
+	int fast;
 
-	memset(dct, 0, sizeof(dct));
-
-	get_huff_code(start, *curbit, ht_dc, &sym, &zero_count, &huff_bits, &value_bits, &value);
-	if (0) {
-		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG,
-			"get_huff_code: sym:%02x huffbits:%u valuebits:%u value:(%u,%d(%d))\n",
-			sym, huff_bits, value_bits, zero_count, value*qt[0], value);
-	}
+	if (b->count < 32)
+		bitreader_refill(b);
 
-	*curbit += (huff_bits + value_bits);
-	dct[0] = *dc + value; /**qt[0];*/
-	*dc = dct[0];
-	dcti = 1;
+	size = huff_decode(b, ht_dc) & 15;
+	if (size)
+		*dc += bitreader_receive_extend(b, size);
 
-	while (dcti < 64) {
-		get_huff_code(start, *curbit, ht_ac, &sym, &zero_count, &huff_bits, &value_bits, &value);
+	for (k = 1; k < 64; ) {
+		if (b->count < 32)
+			bitreader_refill(b);
 
-		if (0) {
-			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG,
-				"get_huff_code: sym:%02x huffbits:%u valuebits:%u value:(%u,%d(%d))\n",
-				sym, huff_bits, value_bits, zero_count, value*qt[dcti+zero_count], value);
+		fast = ht_ac->fast_ac[bitreader_peek(b, HUFF_LOOKAHEAD)];
+		if (fast) {
+			k += ((fast >> 4) & 15) + 1;
+			bitreader_skip(b, fast & 15);
+			continue;
 		}
 
-		*curbit += (huff_bits + value_bits);
-		if (sym == 0) goto done;
-		dcti += zero_count;
-		dct[dcti] = value; /* * qt[dcti]; */
-		dcti++;
+		sym = huff_decode(b, ht_ac);
+		size = sym & 15;
+		if (!size) {
+			if ((sym >> 4) != 15)
+				break; /* EOB */
+			k += 16; /* ZRL */
+			continue;
+		}
+		k += (sym >> 4) + 1;
+		bitreader_skip(b, size);
 	}
-
-done:
-	dezigzag_int_int(dct, dct_dzz);
-	IDCT(dct_dzz, out, qt);
-}
-
-static void ycbcr_to_rgb(int cy, int ccb, int ccr, int *cr, int *cg, int *cb) {
-	*cr = clamp_int(cy+1.402*(ccr-128), 0, 255);
-	*cg = clamp_int(cy-0.71414*(ccr-128)-0.34414*(ccb-128), 0, 255);
-	*cb = clamp_int(cy+1.772*(ccb-128), 0, 255);
 }
 
 static int max_int_2(int x1, int y1) {
@@ -527,238 +886,2618 @@ static int max_int_2(int x1, int y1) {
 	return y1;
 }
 
-static void parse_sos(JPEGDecoder *j)
+/* entropy decode the blocks of one MCU, in component order, with the
+	support of each */
+static void decode_mcu_coef(JPEGDecoder *j, JPEGBitReader *b, int *dc,
+	int16_t *coef, uint8_t *support)
 {
-	const uint8_t *start = j->in+j->current_segment_size;
-	int curbit, i, x, y, cr, cg, cb, ix, iy, dc[3];
-	uint8_t pixels[3][16*16];
-	unsigned data_units_per_mcu = 0;
-	int csh[2] = {1,1}, csm[3][2];
+	int i, n;
 
-	for (i = 0; i < j->components; i++)
-		data_units_per_mcu += j->component[i].sub_x * j->component[i].sub_y;
-
-	if (data_units_per_mcu > 10) {
-		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
-			"too many data units per MCU (%u)", data_units_per_mcu);
-		return;
+	for (i = 0; i < j->components; i++) {
+		for (n = j->component[i].sub_x * j->component[i].sub_y; n; n--) {
+			if (j->component[i].block_size == 1) {
+				/* only the DC is used, the AC terms are just skipped over */
+				skip_block(j->ht[i>0], j->ht[(i>0)+2], b, dc+i);
+				coef[0] = dc[i] * j->dequant[i>0][0];
+				*support = 1;
+			} else {
+				*support = do_mcu(j, j->ht[i>0], j->ht[(i>0)+2], b, dc+i,
+					j->dequant[i>0], coef);
+			}
+			coef += 64;
+			support++;
+		}
 	}
+}
 
-	for (i = 0; i < j->components; i++) {
-		csh[0] = max_int_2(j->component[i].sub_x, csh[0]);
-		csh[1] = max_int_2(j->component[i].sub_y, csh[1]);
+/* MCUs reconstructed together : one IDCT call for all their blocks, then
+	colour conversion along whole rows of them */
+#define MCU_BATCH 32
+
+/* chroma of MCUs ix..ix+n-1 of row iy, from planes 'cb' and 'cr' into the
+	shared plane of NV12 */
+static void write_nv12_chroma(JPEGDecoder *j, const uint8_t *cb,
+	const uint8_t *cr, unsigned pstride, unsigned ix, unsigned n, unsigned iy)
+{
+	const Image_Plane *plane = &j->image->plane[1];
+	unsigned x, y, w, h;
+	uint8_t *out;
+
+	w = n * j->component[1].sub_x * j->block_size;
+	h = j->component[1].sub_y * j->block_size;
+	out = plane->data + iy * h * plane->stride
+		+ ix * j->component[1].sub_x * j->block_size * 2;
+
+	for (y = 0; y < h; y++, out += plane->stride, cb += pstride, cr += pstride) {
+		for (x = 0; x < w; x++) {
+			out[x*2] = cb[x];
+			out[x*2 + 1] = cr[x];
+		}
 	}
+}
 
-	for (i = 0; i < j->components; i++) {
-		csm[i][0] = csh[0] / j->component[i].sub_x;
-		csm[i][1] = csh[1] / j->component[i].sub_y;
-	}
-
-	ix = iy = dc[0] = dc[1] = dc[2] = 0;
-	curbit = 0;
-
-	for (iy = 0; iy < j->mcu_y; iy++) {
-		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "MCU row %u:", (unsigned)iy);
-		for (ix = 0; ix < j->mcu_x; ix++) {
-			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, " %u", (unsigned)ix);
-
-			for (i = 0; i < j->components; i++)
-				for (y = 0; y < j->component[i].sub_y; y++)
-					for (x = 0; x < j->component[i].sub_x; x++)
-						do_mcu(j, j->ht[i>0], j->ht[(i>0)+2], j->qt[i>0],
-							start, &curbit, dc+i, pixels[i]+(x+y*16)*8);
-
-			for (y=0; y<j->mcu_size_y; y++) {
-				for (x=0; x<j->mcu_size_x; x++) {
-					ycbcr_to_rgb(
-						pixels[0][x/csm[0][0]+y/csm[0][1]*16]
-						,(pixels[2][x/csm[2][0]+y/csm[2][1]*16])
-						,(pixels[1][x/csm[1][0]+y/csm[1][1]*16])
-						,&cr, &cg, &cb
-					);
-					write_pixel(j
-						,ix*j->mcu_size_x+x
-						,iy*j->mcu_size_y+y
-						,cr, cg, cb
-					);
+/* keep the coefficients of MCUs ix..ix+n-1 of row iy */
+static void store_coefficients(JPEGDecoder *j, const int16_t *coef,
+	unsigned ix, unsigned n, unsigned iy)
+{
+	JPEGCoefficients_Component *component;
+	int16_t *out;
+	unsigned i, m, x, y, k;
+	int v;
+
+	for (m = 0; m < n; m++) {
+		for (i = 0; i < j->components; i++) {
+			component = &j->coefficients->component[i];
+			for (y = 0; y < component->sub_y; y++) {
+				for (x = 0; x < component->sub_x; x++, coef += 64) {
+					out = component->coef + ((size_t)(iy * component->sub_y + y)
+						* component->blocks_x + (ix + m) * component->sub_x + x) * 64;
+					if (!j->dequantise) {
+						memcpy(out, coef, 64 * sizeof *out);
+						continue;
+					}
+					for (k = 0; k < 64; k++) {
+						v = coef[k] * j->qt[i>0][k];
+						out[k] = v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+					}
 				}
 			}
 		}
+	}
+}
+
+/* zero what do_mcu wrote to 'count' blocks, ready for the next ones */
+static void clear_blocks(int16_t *coef, const uint8_t *support,
+	unsigned count)
+{
+	unsigned y;
 
-		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "\n");
+	for (; count; count--, coef += 64, support++) {
+		switch (*support) {
+		case 1:
+			coef[0] = 0;
+			break;
+		case 2:
+			coef[0] = coef[1] = coef[8] = coef[9] = 0;
+			break;
+		case 4:
+			for (y = 0; y < 32; y += 8)
+				memset(coef + y, 0, 4 * sizeof *coef);
+			break;
+		default:
+			memset(coef, 0, 64 * sizeof *coef);
+			break;
+		}
 	}
+}
 
-	JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "parse_sos exit\n");
+/* where row y of the image goes in the packed output, y being in the MCU
+	row which is being decoded */
+static uint8_t *row_address(JPEGDecoder *j, unsigned y)
+{
+	if (j->strip)
+		return j->pixel_data_start + (y % j->mcu_size_y) * j->stride;
+	return j->pixel_data_start + (y - j->crop_y) * j->stride;
 }
 
-/* get huffman table(s) from segment */
-static void parse_dht(JPEGDecoder *j)
+/* IDCT the blocks of MCUs ix..ix+n-1 of row iy into the image, colour
+	converting them for BGR output.  Their coefficients are cleared after. */
+static void reconstruct_mcus(JPEGDecoder *j, int16_t *coef,
+	const uint8_t *support, unsigned ix, unsigned n, unsigned iy)
 {
-	const uint8_t *in, *end, *htf, *hts;
-	int ht_index, fb, index = 0;
-	uint8_t *ht, tf, s, *f1, *f2;
-	uint_fast16_t c;
+	/* each component's samples for the whole run, side by side */
+	uint8_t planes[3][16 * MCU_BATCH*16];
+	const unsigned pstride = MCU_BATCH*16;
+	JPEGIDCTBlock blocks[3][MCU_BATCH*4];
+	unsigned count[3] = { 0, 0, 0 };
+	const Image_Plane *plane;
+	uint8_t *base[3];
+	unsigned bstride[3];
+	const uint8_t *luma, *cb, *cr;
+	JPEGIDCTBlock *block;
+	const int16_t *in = coef;
+	unsigned i, m, x, y, bs, h[3], x0, x1, y0, y1;
+	uint8_t *out;
+	JPEGColourRow row;
+
+	if (j->coefficients) {
+		store_coefficients(j, coef, ix, n, iy);
+		clear_blocks(coef, support, n * j->blocks_per_mcu);
+		return;
+	}
 
-	in = j->current_segment_start + 2;
-	end = j->current_segment_end;
+	/* planar output with a plane to itself takes the samples as they are */
+	for (i = 0; i < j->components; i++) {
+		plane = &j->image->plane[i];
+		if (j->image->planes && plane->step == 1) {
+			bstride[i] = plane->stride;
+			base[i] = plane->data
+				+ iy * j->component[i].sub_y * j->block_size * plane->stride
+				+ ix * j->component[i].sub_x * j->block_size;
+		} else {
+			bstride[i] = pstride;
+			base[i] = planes[i];
+		}
+	}
 
-	while (in < end) {
-		ht_index = ((*in & 0x10) >> 3) | (*in & 1);
-		ht = j->ht[ht_index];
-		htf = in+1;
-		hts = in+17;
-		fb = 1;
-		c = 0;
-		s = 0;
-		f2 = ht;
-
-		while (htf < in+17)	{
-			tf = *htf++;
-			while (tf) {
-				s = *hts++;
-				f1 = ht + c*2;
-				f2 = ht + (c | (0xffff >> fb))*2;
-				while (f1 <= f2) {
-					f1[0] = fb;
-					f1[1] = s;
-					f1 += 2;
-					index++;
+	/* components may be reconstructed at different sizes, so each has a
+		batch of its own */
+	for (m = 0; m < n; m++) {
+		for (i = 0; i < j->components; i++) {
+			bs = j->component[i].block_size;
+			for (y = 0; y < j->component[i].sub_y; y++) {
+				for (x = 0; x < j->component[i].sub_x; x++) {
+					block = &blocks[i][count[i]++];
+					block->coef = in;
+					block->out = base[i] + (m*j->component[i].sub_x + x) * bs
+						+ y * bs * bstride[i];
+					block->stride = bstride[i];
+					block->support = support[(in - coef) / 64];
+					in += 64;
 				}
-				c += 1 << (16 - fb);
-				tf--;
 			}
-			fb++;
 		}
-		fb--;
-		while (f2<ht+0x20000)
-		{
-			f2[0] = fb;
-			f2[1] = s;
-			f2 += 2;
+	}
+
+	for (i = 0; i < j->components; i++)
+		j->component[i].idct(blocks[i], count[i]);
+	clear_blocks(coef, support, n * j->blocks_per_mcu);
+
+	if (j->output == JPEGDECODER_OUTPUT_NV12)
+		write_nv12_chroma(j, planes[1], planes[2], pstride, ix, n, iy);
+	if (j->image->planes)
+		return;
+
+	/* clipped to the output window : pixels x0..x1-1 of lines y0..y1-1 of
+		the run are written */
+	x0 = j->crop_x > ix * j->mcu_size_x ? j->crop_x - ix * j->mcu_size_x : 0;
+	x1 = n * j->mcu_size_x;
+	if (ix * j->mcu_size_x + x1 > j->limit_x)
+		x1 = j->limit_x - ix * j->mcu_size_x;
+	y0 = j->crop_y > iy * j->mcu_size_y ? j->crop_y - iy * j->mcu_size_y : 0;
+	y1 = j->mcu_size_y;
+	if (iy * j->mcu_size_y + y1 > j->limit_y)
+		y1 = j->limit_y - iy * j->mcu_size_y;
+
+	row = j->colour_row;
+	for (i = 0; i < j->components; i++)
+		h[i] = j->csm[i][0];
+
+	for (y = y0; y < y1; y++) {
+		out = row_address(j, iy * j->mcu_size_y + y)
+			+ (ix * j->mcu_size_x + x0 - j->crop_x) * j->pixel_size;
+		luma = planes[0] + y / j->csm[0][1] * pstride;
+		if (j->components == 1) {
+			row(luma + x0, NULL, NULL, out, x1 - x0, j->alpha);
+			continue;
+		}
+		cb = planes[1] + y / j->csm[1][1] * pstride;
+		cr = planes[2] + y / j->csm[2][1] * pstride;
+		x = x0;
+		if (x & 1) {
+			/* a window starting between two pixels which share samples takes
+				its first one on its own */
+			JPEGColour_row(luma + x / h[0], cb + x / h[1], cr + x / h[2], h,
+				out, 1, j->output, j->alpha);
+			out += j->pixel_size;
+			x++;
 		}
-		in = hts;
+		if (x >= x1)
+			continue;
+		if (row)
+			row(luma + x, cb + x / h[1], cr + x / h[2], out, x1 - x, j->alpha);
+		else
+			JPEGColour_row(luma + x / h[0], cb + x / h[1], cr + x / h[2], h,
+				out, x1 - x, j->output, j->alpha);
 	}
 }
 
-Image_Result Image_read_format_memory_JPEG(
-	Image *image, uint8_t *start, uint8_t *end
-)
+/* advance past one MCU, keeping only the DC predictors */
+static void skip_mcu(JPEGDecoder *j, JPEGBitReader *b, int *dc)
 {
-	uint8_t segment;
-	uint8_t *scan_in, *scan_out;
-	int i;
-	JPEGDecoder j;
-	Image_Result image_result = IMAGE_RESULT_SUCCESS;
-#ifdef BENCHMARK
-	struct timeval tv_start, tv_end;
-	double tf_start, tf_end;
-#endif
+	int i, n;
 
-	memset(&j, 0, sizeof(j));
-	j.in = start;
-	j.image = image;
-	j.log_level = JPEGDECODER_LOGLEVEL_FATAL;
+	for (i = 0; i < j->components; i++)
+		for (n = j->component[i].sub_x * j->component[i].sub_y; n; n--)
+			skip_block(j->ht[i>0], j->ht[(i>0)+2], b, dc+i);
+}
+
+/* entropy decode MCU column ix of a row into 'coef' and 'support' if it is
+	in the output window, otherwise only step over it */
+static void decode_mcu_window(JPEGDecoder *j, JPEGBitReader *b, int *dc,
+	int16_t *coef, uint8_t *support, unsigned ix)
+{
+	if (ix >= j->mcu_x0 && ix < j->mcu_x1)
+		decode_mcu_coef(j, b, dc, coef, support);
+	else
+		skip_mcu(j, b, dc);
+}
+
+/* reconstruct the MCUs of row iy in the output window, from the
+	coefficients of the whole row */
+static void reconstruct_row(JPEGDecoder *j, int16_t *coef,
+	const uint8_t *support, unsigned iy)
+{
+	const size_t mcu_coef = j->blocks_per_mcu * 64;
+	unsigned ix, n;
 
-	for (i=0; i<4; i++) {
-		j.ht[i] = (uint8_t *)malloc(0x20000);
+	for (ix = j->mcu_x0; ix < j->mcu_x1; ix += n) {
+		n = j->mcu_x1 - ix < MCU_BATCH ? j->mcu_x1 - ix : MCU_BATCH;
+		reconstruct_mcus(j, coef + ix * mcu_coef,
+			support + ix * j->blocks_per_mcu, ix, n, iy);
 	}
+}
 
-#ifdef BENCHMARK
-	i = gettimeofday(&tv_start, NULL);
-#endif
+static int add_checkpoint(JPEGDecoder *j, unsigned mcu,
+	const JPEGBitReader *b, const int *dc)
+{
+	JPEGCheckpoint *checkpoint;
+
+	if (j->checkpoint_count == j->checkpoint_size) {
+		j->checkpoint_size = j->checkpoint_size ? j->checkpoint_size * 2 : 64;
+		checkpoint = (JPEGCheckpoint *)realloc(j->checkpoint,
+			j->checkpoint_size * sizeof *checkpoint);
+		if (!checkpoint)
+			return 0;
+		j->checkpoint = checkpoint;
+	}
 
-	while (j.in + 3 < end) {
-		scan_in = NULL;
-		segment = j.in[1];
-		j.current_segment_size = 256*j.in[2] + j.in[3];
+	checkpoint = &j->checkpoint[j->checkpoint_count++];
+	checkpoint->mcu = mcu;
+	checkpoint->b = *b;
+	memcpy(checkpoint->dc, dc, sizeof checkpoint->dc);
+	return 1;
+}
 
-		JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_INFO,
-			"%08x: segment:%02x size:%u\n",
-			(unsigned)(j.in - start),
-			(unsigned)segment, (unsigned)j.current_segment_size);
+/* before decoding MCU c->mcu of a run which started at 'first' : at a
+	restart interval boundary, move on past the RSTn marker and start again
+	with zeroed DC predictors.  0 if there was no RSTn to be found. */
+static int checkpoint_restart(JPEGDecoder *j, JPEGCheckpoint *c,
+	unsigned first)
+{
+	if (c->mcu != first && c->mcu % j->restart_interval == 0) {
+		memset(c->dc, 0, sizeof c->dc);
+		return bitreader_restart(&c->b);
+	}
+	return 1;
+}
+
+/* every restart interval is an entry point with zeroed DC predictors */
+static int add_restart_checkpoints(JPEGDecoder *j)
+{
+	JPEGBitReader b;
+	const int dc[3] = { 0, 0, 0 };
+	unsigned k;
+
+	for (k = 0; k < j->restart_count; k++) {
+		bitreader_init(&b, j->restart[k], j->scan_end);
+		if (!add_checkpoint(j, k * j->restart_interval, &b, dc))
+			return 0;
+	}
 
-		j.in += 2;
+	return 1;
+}
 
-		j.current_segment_start = j.in;
-		j.current_segment_end = j.in + j.current_segment_size;
+/* without restart markers the bit position and DC predictors carry across
+	the whole scan, so find them at the start of every MCU row with a pass
+	which only entropy decodes, for threads to start from */
+static int add_row_checkpoints(JPEGDecoder *j)
+{
+	JPEGCheckpoint c;
+	unsigned ix, iy;
 
-		switch (segment) {
-		case 0xd8:/*SOI*/
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_DEBUG, "SOI\n");
-			j.current_segment_size = 0;
-			break;
-		case 0xe0:/*APP0*/
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_DEBUG, "APP0\n");
-			break;
-		case 0xdb:/*DQT*/
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_DEBUG, "DQT\n");
-			parse_dqt(&j);
-			break;
-		case 0xc0:/*SOF0*/
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_DEBUG, "SOF0\n");
-			parse_sof(&j);
+	memset(&c, 0, sizeof c);
+	bitreader_init(&c.b, j->scan_start, j->scan_end);
+
+	for (iy = 0; iy < j->mcu_y1; iy++) {
+		if (!add_checkpoint(j, c.mcu, &c.b, c.dc))
+			return 0;
+		if (iy + 1 == j->mcu_y1)
 			break;
-		case 0xc4:/*DHT*/
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_DEBUG, "DHT\n");
-			parse_dht(&j);
+		for (ix = 0; ix < j->mcu_x; ix++, c.mcu++) {
+			checkpoint_restart(j, &c, 0);
+			skip_mcu(j, &c.b, c.dc);
+		}
+	}
+
+	return 1;
+}
+
+/* MCUs between index entries by default */
+#define INDEX_INTERVAL 32
+
+/* bytes at the start of the scan which an index checks it was built from */
+#define INDEX_HASH_SIZE 4096
+
+/* FNV-1a of the start of the scan */
+static uint32_t scan_hash(const JPEGDecoder *j)
+{
+	size_t size = j->scan_end - j->scan_start;
+
+	return hash_bytes(j->scan_start,
+		size < INDEX_HASH_SIZE ? size : INDEX_HASH_SIZE);
+}
+
+static int index_matches(const JPEGDecoder *j, const JPEGIndex *index)
+{
+	return index->mcu_x == j->mcu_x && index->mcu_y == j->mcu_y
+		&& index->restart_interval == j->restart_interval
+		&& index->scan_size == (uint64_t)(j->scan_end - j->scan_start)
+		&& index->scan_hash == scan_hash(j);
+}
+
+static void index_checkpoint(const JPEGDecoder *j, const JPEGIndexEntry *e,
+	JPEGCheckpoint *c)
+{
+	c->mcu = e->mcu;
+	c->b.in = j->scan_start + e->offset;
+	c->b.end = j->scan_end;
+	c->b.bits = e->bits;
+	c->b.count = e->count;
+	c->b.pad = e->pad;
+	memcpy(c->dc, e->dc, sizeof c->dc);
+}
+
+/* with an index, move 'c' on to the last entry at or before MCU 'mcu' if
+	that is ahead of it : 1 if it moved */
+static int seek(const JPEGDecoder *j, JPEGCheckpoint *c, unsigned mcu)
+{
+	const JPEGIndex *index = j->index;
+	unsigned lo, hi, mid;
+
+	if (!index || !index->count)
+		return 0;
+
+	/* entries lo.. are after 'mcu' */
+	for (lo = 0, hi = index->count; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (index->entry[mid].mcu <= mcu)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || index->entry[lo - 1].mcu <= c->mcu)
+		return 0;
+
+	index_checkpoint(j, &index->entry[lo - 1], c);
+	return 1;
+}
+
+/* every index entry is an entry point */
+static int add_index_checkpoints(JPEGDecoder *j)
+{
+	JPEGCheckpoint c;
+	unsigned k;
+
+	for (k = 0; k < j->index->count; k++) {
+		index_checkpoint(j, &j->index->entry[k], &c);
+		if (!add_checkpoint(j, c.mcu, &c.b, c.dc))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* entropy decode the whole scan, recording the state every so many MCUs
+	after any restart there, so that decoding can start from it with
+	nothing left to do first.  0 if out of memory. */
+static int build_index(JPEGDecoder *j)
+{
+	JPEGIndex *index = j->index_build;
+	JPEGIndexEntry *entry;
+	JPEGCheckpoint c;
+
+	if (!index->interval)
+		index->interval = INDEX_INTERVAL;
+
+	memset(&c, 0, sizeof c);
+	bitreader_init(&c.b, j->scan_start, j->scan_end);
+
+	for (; c.mcu < j->mcu_x * j->mcu_y; c.mcu++) {
+		checkpoint_restart(j, &c, 0);
+
+		if (c.mcu % index->interval == 0) {
+			if (index->count == index->size) {
+				index->size = index->size ? index->size * 2 : 64;
+				entry = (JPEGIndexEntry *)realloc(index->entry,
+					index->size * sizeof *entry);
+				if (!entry)
+					return 0;
+				index->entry = entry;
+			}
+			entry = &index->entry[index->count++];
+			entry->mcu = c.mcu;
+			entry->offset = c.b.in - j->scan_start;
+			entry->bits = c.b.bits;
+			entry->count = c.b.count;
+			entry->pad = c.b.pad;
+			memcpy(entry->dc, c.dc, sizeof entry->dc);
+		}
+
+		skip_mcu(j, &c.b, c.dc);
+	}
+
+	index->mcu_x = j->mcu_x;
+	index->mcu_y = j->mcu_y;
+	index->restart_interval = j->restart_interval;
+	index->scan_size = j->scan_end - j->scan_start;
+	index->scan_hash = scan_hash(j);
+	return 1;
+}
+
+/* whether any of MCUs first..last-1 is in the output window */
+static int span_in_window(const JPEGDecoder *j, unsigned first,
+	unsigned last)
+{
+	unsigned iy;
+
+	iy = first / j->mcu_x > j->mcu_y0 ? first / j->mcu_x : j->mcu_y0;
+	for (; iy < j->mcu_y1 && iy * j->mcu_x < last; iy++) {
+		if (iy * j->mcu_x + j->mcu_x0 < last
+			&& iy * j->mcu_x + j->mcu_x1 > first)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* decode MCUs c->mcu up to 'last' of a run which started at 'first', and
+	write their pixels to the image.  MCUs outside the output window are
+	jumped over with the index if there is one, otherwise only entropy
+	decoded, to keep the bit position and DC predictors. */
+static void decode_span(JPEGDecoder *j, JPEGCheckpoint *c, unsigned first,
+	unsigned last)
+{
+	int16_t coef[MCU_BATCH*10*64];
+	uint8_t support[MCU_BATCH*10];
+	const size_t mcu_coef = j->blocks_per_mcu * 64;
+	unsigned ix, iy, n, end;
+
+	/* kept zero between batches by reconstruct_mcus */
+	memset(coef, 0, MCU_BATCH * mcu_coef * sizeof *coef);
+
+	while (c->mcu < last) {
+		ix = c->mcu % j->mcu_x;
+		iy = c->mcu / j->mcu_x;
+		if (iy < j->mcu_y0 || ix < j->mcu_x0 || ix >= j->mcu_x1) {
+			/* on to the next MCU in the window */
+			end = iy < j->mcu_y0 ? j->mcu_y0 * j->mcu_x + j->mcu_x0
+				: ix < j->mcu_x0 ? iy * j->mcu_x + j->mcu_x0
+				: (iy + 1) * j->mcu_x + j->mcu_x0;
+			if (end > last)
+				end = last;
+			/* an entry is after any restart at its MCU, which only this
+				call knows not to do again, so it has to stop short of 'last' */
+			if (seek(j, c, end < last ? end : last - 1))
+				first = c->mcu;
+			for (; c->mcu < end; c->mcu++) {
+				checkpoint_restart(j, c, first);
+				skip_mcu(j, &c->b, c->dc);
+			}
+			continue;
+		}
+		end = (iy + 1) * j->mcu_x < last ? (iy + 1) * j->mcu_x : last;
+		if (end > iy * j->mcu_x + j->mcu_x1)
+			end = iy * j->mcu_x + j->mcu_x1;
+		for (n = 0; n < MCU_BATCH && c->mcu < end; n++, c->mcu++) {
+			checkpoint_restart(j, c, first);
+			decode_mcu_coef(j, &c->b, c->dc, coef + n * mcu_coef,
+				support + n * j->blocks_per_mcu);
+		}
+		reconstruct_mcus(j, coef, support, ix, n, iy);
+	}
+}
+
+/* decode from checkpoint 'k' up to the next one */
+static void decode_checkpoint(JPEGDecoder *j, unsigned k)
+{
+	JPEGCheckpoint c = j->checkpoint[k];
+	unsigned last;
+
+	/* nothing after the output window needs decoding */
+	last = k + 1 < j->checkpoint_count
+		? j->checkpoint[k + 1].mcu : j->mcu_x * j->mcu_y1;
+	if (last > j->mcu_x * j->mcu_y1)
+		last = j->mcu_x * j->mcu_y1;
+	if (!span_in_window(j, c.mcu, last))
+		return;
+
+	decode_span(j, &c, c.mcu, last);
+}
+
+static void *checkpoint_worker(void *arg)
+{
+	JPEGDecoder *j = (JPEGDecoder *)arg;
+	unsigned k;
+
+	/* checkpoints cover disjoint MCUs of the image, so workers only need to
+		agree on who decodes which */
+	while ((k = __sync_fetch_and_add(&j->checkpoint_next, 1)) < j->checkpoint_count)
+		decode_checkpoint(j, k);
+
+	return NULL;
+}
+
+/* slots of the coefficient ring buffer between the entropy decoder and the
+	reconstruction workers, per worker */
+#define PIPELINE_SLOTS_PER_WORKER 2
+
+/* a ring of MCU rows of coefficients, filled in order by the entropy
+	decoding thread and emptied by the reconstruction workers */
+typedef struct JPEGPipeline_t {
+	pthread_mutex_t lock;
+	pthread_cond_t filled, freed;
+	int16_t *coef;
+	uint8_t *support; /* of each block */
+	size_t row_blocks; /* blocks per MCU row */
+	unsigned slots;
+	uint8_t *busy; /* slot holds a row not yet reconstructed */
+	unsigned rows_decoded, rows_claimed;
+	int finished;
+} JPEGPipeline;
+
+static void *pipeline_worker(void *arg)
+{
+	JPEGDecoder *j = (JPEGDecoder *)arg;
+	JPEGPipeline *p = j->pipeline;
+	unsigned row;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->rows_claimed == p->rows_decoded && !p->finished)
+			pthread_cond_wait(&p->filled, &p->lock);
+		if (p->rows_claimed == p->rows_decoded) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		row = p->rows_claimed++;
+		pthread_mutex_unlock(&p->lock);
+
+		reconstruct_row(j, p->coef + (row % p->slots) * p->row_blocks * 64,
+			p->support + (row % p->slots) * p->row_blocks, row);
+
+		pthread_mutex_lock(&p->lock);
+		p->busy[row % p->slots] = 0;
+		pthread_cond_signal(&p->freed);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return NULL;
+}
+
+/* entropy decode on this thread, overlapped with IDCT and colour conversion
+	of earlier rows on 'workers' other threads */
+static void decode_pipelined(JPEGDecoder *j, unsigned workers)
+{
+	JPEGPipeline p;
+	JPEGCheckpoint c;
+	pthread_t *thread;
+	int16_t *coef;
+	uint8_t *support;
+	unsigned first, row, ix, t;
+
+	memset(&p, 0, sizeof p);
+	p.slots = workers * PIPELINE_SLOTS_PER_WORKER;
+	p.row_blocks = (size_t)j->mcu_x * j->blocks_per_mcu;
+	p.coef = (int16_t *)scratch_alloc(j, JPEGSCRATCH_RING,
+		p.slots * p.row_blocks * 64 * sizeof *p.coef);
+	p.support = (uint8_t *)scratch_alloc(j, JPEGSCRATCH_RING_SUPPORT,
+		p.slots * p.row_blocks);
+	p.busy = (uint8_t *)scratch_alloc(j, JPEGSCRATCH_RING_BUSY, p.slots);
+	thread = (pthread_t *)malloc(workers * sizeof *thread);
+
+	if (!p.coef || !p.support || !p.busy || !thread) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"cannot allocate pipeline buffers\n");
+		j->decoded = 0;
+		goto done;
+	}
+
+	memset(p.coef, 0, p.slots * p.row_blocks * 64 * sizeof *p.coef);
+	memset(p.busy, 0, p.slots);
+
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.filled, NULL);
+	pthread_cond_init(&p.freed, NULL);
+	p.rows_decoded = p.rows_claimed = j->mcu_y0;
+	j->pipeline = &p;
+
+	for (t = 0; t < workers; t++) {
+		if (pthread_create(&thread[t], NULL, pipeline_worker, j) != 0)
+			break;
+	}
+
+	if (!t) {
+		/* no workers could be started, decode serially */
+		j->checkpoint_next = 0;
+		checkpoint_worker(j);
+		goto destroy;
+	}
+
+	c = j->checkpoint[0];
+
+	/* rows above the output window are only stepped over */
+	first = seek(j, &c, j->mcu_y0 * j->mcu_x) ? c.mcu : 0;
+	for (; c.mcu < j->mcu_y0 * j->mcu_x; c.mcu++) {
+		checkpoint_restart(j, &c, first);
+		skip_mcu(j, &c.b, c.dc);
+	}
+
+	for (row = j->mcu_y0; row < j->mcu_y1; row++) {
+		pthread_mutex_lock(&p.lock);
+		while (p.busy[row % p.slots])
+			pthread_cond_wait(&p.freed, &p.lock);
+		pthread_mutex_unlock(&p.lock);
+
+		coef = p.coef + (row % p.slots) * p.row_blocks * 64;
+		support = p.support + (row % p.slots) * p.row_blocks;
+		for (ix = 0; ix < j->mcu_x; ix++, c.mcu++) {
+			checkpoint_restart(j, &c, first);
+			decode_mcu_window(j, &c.b, c.dc, coef + ix * j->blocks_per_mcu * 64,
+				support + ix * j->blocks_per_mcu, ix);
+		}
+
+		pthread_mutex_lock(&p.lock);
+		p.busy[row % p.slots] = 1;
+		p.rows_decoded = row + 1;
+		pthread_cond_signal(&p.filled);
+		pthread_mutex_unlock(&p.lock);
+	}
+
+	pthread_mutex_lock(&p.lock);
+	p.finished = 1;
+	pthread_cond_broadcast(&p.filled);
+	pthread_mutex_unlock(&p.lock);
+
+	while (t--)
+		pthread_join(thread[t], NULL);
+
+destroy:
+	pthread_cond_destroy(&p.freed);
+	pthread_cond_destroy(&p.filled);
+	pthread_mutex_destroy(&p.lock);
+	j->pipeline = NULL;
+
+done:
+	free(thread);
+	scratch_free(j, p.busy);
+	scratch_free(j, p.support);
+	scratch_free(j, p.coef);
+}
+
+/* pass MCU row 'iy', which has just been written, on to the rows callback */
+static void emit_rows(JPEGDecoder *j, unsigned iy)
+{
+	unsigned y, end;
+
+	if (!j->rows)
+		return;
+
+	/* the part of it in the output window */
+	y = iy * j->mcu_size_y > j->crop_y ? iy * j->mcu_size_y : j->crop_y;
+	end = (iy + 1) * j->mcu_size_y;
+	if (end > j->crop_y + j->height)
+		end = j->crop_y + j->height;
+	if (y >= end)
+		return;
+
+	j->rows(j->rows_user, row_address(j, y), j->stride, y - j->crop_y,
+		end - y);
+}
+
+/* rows decoded by several threads are finished in no particular order, so
+	they are passed on together at the end */
+static void emit_all_rows(JPEGDecoder *j)
+{
+	if (j->rows)
+		j->rows(j->rows_user, j->pixel_data_start, j->stride, 0, j->height);
+}
+
+/* decode the whole scan on this thread in order, a row at a time, so each
+	row can be passed on as soon as it is done */
+static void decode_rows(JPEGDecoder *j)
+{
+	JPEGCheckpoint c;
+	unsigned row;
+
+	c = j->checkpoint[0];
+
+	for (row = 0; row < j->mcu_y1; row++) {
+		decode_span(j, &c, 0, (row + 1) * j->mcu_x);
+		emit_rows(j, row);
+	}
+}
+
+/* the colour conversion kernel for the scan's layout, once the size each
+	component is reconstructed at is known */
+static void choose_colour_row(JPEGDecoder *j)
+{
+	const JPEGColourRow *row = j->colour->row[j->output];
+
+	/* full resolution luma with both chroma components alike, and at most
+		halved across, is what nearly every colour file uses */
+	j->colour_row = NULL;
+	if (j->components == 1) {
+		j->colour_row = row[2];
+	} else if (j->csm[0][0] == 1 && j->csm[0][1] == 1
+		&& j->csm[1][0] == j->csm[2][0] && j->csm[1][1] == j->csm[2][1]
+	) {
+		if (j->csm[1][0] == 1)
+			j->colour_row = row[0];
+		else if (j->csm[1][0] == 2)
+			j->colour_row = row[1];
+	}
+}
+
+/* set up for decoding a scan once its tables are all known, 0 if the
+	headers so far don't describe something we can decode */
+static int start_scan(JPEGDecoder *j)
+{
+	int i, k;
+	unsigned bs;
+	int csh[2] = {1,1};
+
+	if (!j->mcu_x || !j->mcu_y || (!j->pixel_data_start && !j->index_build
+		&& !(j->coefficients && j->coefficients->data))
+	) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL, "SOS before a valid SOF\n");
+		return 0;
+	}
+
+	if (j->bad_tables) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"SOS after an invalid DHT\n");
+		return 0;
+	}
+
+	j->blocks_per_mcu = 0;
+	for (i = 0; i < j->components; i++)
+		j->blocks_per_mcu += j->component[i].sub_x * j->component[i].sub_y;
+
+	if (j->blocks_per_mcu > 10) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"too many data units per MCU (%u)", j->blocks_per_mcu);
+		return 0;
+	}
+
+	/* MCUs are at most 16x16 samples */
+	for (i = 0; i < j->components; i++) {
+		if (!j->component[i].sub_x || j->component[i].sub_x > 2
+			|| !j->component[i].sub_y || j->component[i].sub_y > 2
+		) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+				"unsupported sampling factors %ux%u\n",
+				j->component[i].sub_x, j->component[i].sub_y);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < j->components; i++) {
+		csh[0] = max_int_2(j->component[i].sub_x, csh[0]);
+		csh[1] = max_int_2(j->component[i].sub_y, csh[1]);
+	}
+
+	/* when scaling down, subsampled components are reconstructed with a
+		larger IDCT instead of being upsampled where the ratios allow,
+		as libjpeg does; planar output keeps them at their own resolution */
+	for (i = 0; i < j->components; i++) {
+		bs = j->block_size;
+		while (bs < 8 && j->output != JPEGDECODER_OUTPUT_I420
+			&& j->output != JPEGDECODER_OUTPUT_NV12
+			&& (csh[0] * j->block_size) % (j->component[i].sub_x * bs * 2) == 0
+			&& (csh[1] * j->block_size) % (j->component[i].sub_y * bs * 2) == 0
+		) {
+			bs *= 2;
+		}
+		j->component[i].block_size = bs;
+		j->component[i].idct = bs == 8 ? j->idct->blocks
+			: bs == 4 ? JPEGIDCT_4x4_blocks
+			: bs == 2 ? JPEGIDCT_2x2_blocks : JPEGIDCT_1x1_blocks;
+	}
+
+	/* sample replication of each component, in output samples */
+	for (i = 0; i < j->components; i++) {
+		j->csm[i][0] = csh[0] * j->block_size
+			/ (j->component[i].sub_x * j->component[i].block_size);
+		j->csm[i][1] = csh[1] * j->block_size
+			/ (j->component[i].sub_y * j->component[i].block_size);
+	}
+
+	choose_colour_row(j);
+
+	/* quantisation tables are final by the time the scan starts */
+	/* do_mcu dequantises as it stores, except for coefficient output */
+	for (i = 0; i < 2; i++)
+		for (k = 0; k < 64; k++)
+			j->dequant[i][k] = j->coefficients ? 1 : j->qt[i][k];
+	if (j->coefficients) {
+		for (i = 0; i < j->components; i++)
+			for (k = 0; k < 64; k++)
+				j->coefficients->component[i].qt[k] = j->qt[i>0][k];
+	}
+
+	/* without restart markers the whole scan is one interval */
+	if (!j->restart_interval)
+		j->restart_interval = j->mcu_x * j->mcu_y;
+
+	return 1;
+}
+
+/* remember that a restart interval starts at 'at' */
+static int add_restart(JPEGDecoder *j, const uint8_t *at)
+{
+	const uint8_t **restart;
+
+	if (j->restart_count == j->restart_size) {
+		j->restart_size = j->restart_size ? j->restart_size * 2 : 64;
+		restart = (const uint8_t **)realloc(j->restart,
+			j->restart_size * sizeof *restart);
+		if (!restart)
+			return 0;
+		j->restart = restart;
+	}
+
+	j->restart[j->restart_count++] = at;
+	return 1;
+}
+
+/* find where each restart interval after the first starts, 0 if out of
+	memory */
+static int find_restart_markers(JPEGDecoder *j)
+{
+	const uint8_t *in = j->scan_start, *end = j->scan_end;
+
+	while ((in = (const uint8_t *)memchr(in, 0xff, end - in)) && end - in >= 2) {
+		if (in[1] == 0) {
+			in += 2;
+		} else if (in[1] >= 0xd0 && in[1] <= 0xd7) {
+			in += 2;
+			if (!add_restart(j, in))
+				return 0;
+		} else if (in[1] == 0xff) {
+			in++;
+		} else {
+			/* end of the scan */
+			break;
+		}
+	}
+
+	return 1;
+}
+
+static void parse_sos(JPEGDecoder *j)
+{
+	unsigned t, threads;
+	pthread_t *workers;
+
+	if (!start_scan(j))
+		return;
+
+	if (j->index_build) {
+		if (!build_index(j))
+			j->index_build->count = 0;
+		return;
+	}
+
+	if (j->index && !index_matches(j, j->index)) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_WARNING,
+			"index is of another file, not used\n");
+		j->index = NULL;
+	}
+
+	/* strips are reused, so their rows have to be decoded in order */
+	threads = j->strip ? 1 : j->threads;
+	j->checkpoint_count = 0;
+
+	/* decoding straight through, the reader moves on past each RSTn as it
+		gets there.  Only threads need to know where the intervals start in
+		advance, which takes a pass looking for the markers. */
+	j->restart_count = 0;
+	if (!add_restart(j, j->scan_start))
+		return;
+
+	if (threads > 1 && !j->pipeline_mode && !j->index
+		&& j->restart_interval < j->mcu_x * j->mcu_y) {
+		if (!find_restart_markers(j))
+			return;
+
+		if (j->restart_count < (j->mcu_x * j->mcu_y + j->restart_interval - 1)
+			/ j->restart_interval) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_WARNING,
+				"scan has %u restart intervals, expected %u\n", j->restart_count,
+				(j->mcu_x * j->mcu_y + j->restart_interval - 1) / j->restart_interval);
+		}
+	}
+
+	if (j->index) {
+		if (!add_index_checkpoints(j))
+			return;
+	} else if (j->restart_count > 1 || threads == 1 || j->pipeline_mode) {
+		if (!add_restart_checkpoints(j))
+			return;
+	} else {
+		if (!add_row_checkpoints(j))
+			return;
+	}
+
+	j->decoded = 1;
+
+	if (threads == 1 && j->rows) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
+			"SOS: %u restart intervals, by rows\n", j->restart_count);
+		decode_rows(j);
+		return;
+	}
+
+	if (threads > 1 && j->pipeline_mode) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
+			"SOS: pipelined, %u restart intervals, %u threads\n",
+			j->restart_count, threads);
+		decode_pipelined(j, threads - 1);
+		emit_all_rows(j);
+		return;
+	}
+
+	if (threads > j->checkpoint_count)
+		threads = j->checkpoint_count;
+
+	JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
+		"SOS: %u restart intervals of %u MCUs, %u entry points, %u threads\n",
+		j->restart_count, j->restart_interval, j->checkpoint_count, threads);
+
+	j->checkpoint_next = 0;
+	workers = NULL;
+	if (threads > 1)
+		workers = (pthread_t *)malloc((threads - 1) * sizeof *workers);
+
+	/* the calling thread is one of the workers */
+	for (t = 0; workers && t < threads - 1; t++) {
+		if (pthread_create(&workers[t], NULL, checkpoint_worker, j) != 0)
+			break;
+	}
+
+	checkpoint_worker(j);
+
+	while (workers && t--)
+		pthread_join(workers[t], NULL);
+	free(workers);
+
+	emit_all_rows(j);
+
+	JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "parse_sos exit\n");
+}
+
+/* define restart interval */
+static void parse_dri(JPEGDecoder *j)
+{
+	if (j->current_segment_size < 4) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"invalid DRI size (%u)\n", j->current_segment_size);
+		return;
+	}
+
+	j->restart_interval = 256*j->in[2] + j->in[3];
+
+	JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
+		"DRI: restart interval %u MCUs\n", j->restart_interval);
+}
+
+/* build the lookup and canonical decoding tables for one Huffman table from
+	the 16 code length counts and the symbol values of a DHT */
+static int build_huffman(JPEGHuffman *h, const uint8_t *counts,
+	const uint8_t *symbols, unsigned nsymbols)
+{
+	unsigned len, i, k, look, fill, run, size;
+	int32_t code;
+	int value;
+
+	memset(h->look_bits, 0, sizeof(h->look_bits));
+	memset(h->fast_ac, 0, sizeof(h->fast_ac));
+	memcpy(h->values, symbols, nsymbols);
+
+	code = 0;
+	k = 0;
+	for (len = 1; len <= 16; len++) {
+		h->valoffset[len] = (int32_t)k - code;
+		/* codes of this length must not run past all-ones, checked before
+			any of them go in the lookahead tables */
+		if (code + counts[len - 1] > 1 << len)
+			return 0;
+		for (i = 0; i < counts[len - 1]; i++, k++, code++) {
+			if (len <= HUFF_LOOKAHEAD) {
+				look = code << (HUFF_LOOKAHEAD - len);
+				for (fill = 0; fill < 1U << (HUFF_LOOKAHEAD - len); fill++) {
+					h->look_bits[look + fill] = len;
+					h->look_sym[look + fill] = symbols[k];
+				}
+			}
+		}
+		h->maxcode[len] = counts[len - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+	h->maxcode[17] = INT32_MAX;
+
+	for (look = 0; look < 1 << HUFF_LOOKAHEAD; look++) {
+		len = h->look_bits[look];
+		run = h->look_sym[look] >> 4;
+		size = h->look_sym[look] & 15;
+		if (!len || !size || len + size > HUFF_LOOKAHEAD)
+			continue;
+		value = (look >> (HUFF_LOOKAHEAD - len - size)) & ((1 << size) - 1);
+		if (value < (1 << (size - 1)))
+			value -= (1 << size) - 1;
+		if (value >= -128 && value <= 127)
+			h->fast_ac[look] = value * 256 + run * 16 + len + size;
+	}
+
+	return 1;
+}
+
+/* the standard tables of Annex K (K.3), which most encoders use, as DHT
+	code counts then symbols : DC luminance, DC chrominance, AC luminance and
+	AC chrominance, in DHT class * 2 + id order */
+static const uint8_t annex_k_dc_luminance[16 + 12] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b
+};
+
+static const uint8_t annex_k_dc_chrominance[16 + 12] = {
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b
+};
+
+static const uint8_t annex_k_ac_luminance[16 + 162] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+	0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+	0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+	0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+	0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+	0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+	0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+	0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+static const uint8_t annex_k_ac_chrominance[16 + 162] = {
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+	0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+	0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+	0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+	0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+	0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+	0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+	0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+	0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+static const uint8_t *const annex_k[4] = {
+	annex_k_dc_luminance, annex_k_dc_chrominance,
+	annex_k_ac_luminance, annex_k_ac_chrominance
+};
+
+/* built tables shared by every decoder in the process, keyed by their DHT
+	code counts and symbols : the Annex K ones from the start, which
+	decoders also use for tables a file doesn't define, and others once
+	they have been seen twice, so that the one-off tables of optimised
+	files don't fill it up.  Entries are never changed once counted in
+	huffman_cache_count, so finding one takes no lock. */
+#define HUFFMAN_CACHE_SIZE 64
+#define HUFFMAN_SEEN_SIZE 64
+
+typedef struct JPEGHuffmanCacheEntry_t {
+	uint32_t hash;
+	unsigned size;
+	uint8_t spec[16 + 256];
+	JPEGHuffman table;
+} JPEGHuffmanCacheEntry;
+
+static JPEGHuffmanCacheEntry huffman_cache[HUFFMAN_CACHE_SIZE];
+static unsigned huffman_cache_count;
+/* hashes of tables which have been built once, but aren't cached */
+static uint32_t huffman_seen[HUFFMAN_SEEN_SIZE];
+static unsigned huffman_seen_next;
+static pthread_mutex_t huffman_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t huffman_cache_once = PTHREAD_ONCE_INIT;
+
+/* the cached table of 'size' bytes of code counts and symbols, or NULL */
+static const JPEGHuffman *huffman_cache_find(uint32_t hash,
+	const uint8_t *spec, unsigned size)
+{
+	unsigned i, count;
+
+	count = __atomic_load_n(&huffman_cache_count, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; i++) {
+		if (huffman_cache[i].hash == hash && huffman_cache[i].size == size
+			&& memcmp(huffman_cache[i].spec, spec, size) == 0
+		) {
+			return &huffman_cache[i].table;
+		}
+	}
+
+	return NULL;
+}
+
+/* with huffman_cache_lock held, or before anyone else can look */
+static void huffman_cache_add(uint32_t hash, const uint8_t *spec,
+	unsigned size, const JPEGHuffman *table)
+{
+	JPEGHuffmanCacheEntry *entry;
+
+	if (huffman_cache_count == HUFFMAN_CACHE_SIZE)
+		return;
+
+	entry = &huffman_cache[huffman_cache_count];
+	entry->hash = hash;
+	entry->size = size;
+	memcpy(entry->spec, spec, size);
+	entry->table = *table;
+	__atomic_store_n(&huffman_cache_count, huffman_cache_count + 1,
+		__ATOMIC_RELEASE);
+}
+
+static unsigned huffman_symbols(const uint8_t *counts)
+{
+	unsigned i, n = 0;
+
+	for (i = 0; i < 16; i++)
+		n += counts[i];
+	return n;
+}
+
+static void huffman_cache_init(void)
+{
+	JPEGHuffman table;
+	unsigned i, nsymbols;
+
+	for (i = 0; i < 4; i++) {
+		nsymbols = huffman_symbols(annex_k[i]);
+		build_huffman(&table, annex_k[i], annex_k[i] + 16, nsymbols);
+		huffman_cache_add(hash_bytes(annex_k[i], 16 + nsymbols), annex_k[i],
+			16 + nsymbols, &table);
+	}
+}
+
+/* use the table of DHT code counts and symbols 'spec' as table 'index',
+	from the cache if it is there and otherwise building it */
+static int load_huffman(JPEGDecoder *j, unsigned index, const uint8_t *spec,
+	unsigned nsymbols)
+{
+	unsigned size = 16 + nsymbols, i;
+	uint32_t hash = hash_bytes(spec, size);
+	const JPEGHuffman *cached = huffman_cache_find(hash, spec, size);
+	int seen = 0;
+
+	if (cached) {
+		j->ht[index] = cached;
+		return 1;
+	}
+
+	if (!build_huffman(&j->ht_built[index], spec, spec + 16, nsymbols))
+		return 0;
+	j->ht[index] = &j->ht_built[index];
+
+	pthread_mutex_lock(&huffman_cache_lock);
+	for (i = 0; i < HUFFMAN_SEEN_SIZE; i++)
+		seen |= huffman_seen[i] == hash;
+	if (!seen)
+		huffman_seen[huffman_seen_next++ % HUFFMAN_SEEN_SIZE] = hash;
+	else if (!huffman_cache_find(hash, spec, size))
+		huffman_cache_add(hash, spec, size, &j->ht_built[index]);
+	pthread_mutex_unlock(&huffman_cache_lock);
+
+	return 1;
+}
+
+/* get huffman table(s) from segment */
+static void parse_dht(JPEGDecoder *j)
+{
+	const uint8_t *in, *end;
+	unsigned ht_index, nsymbols;
+
+	in = j->current_segment_start + 2;
+	end = j->current_segment_end;
+
+	while (end - in >= 17) {
+		ht_index = ((*in & 0x10) >> 3) | (*in & 1);
+
+		nsymbols = huffman_symbols(in + 1);
+
+		if (nsymbols > 256 || end - (in + 17) < nsymbols) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+				"invalid DHT table (%u symbols)\n", nsymbols);
+			j->bad_tables = 1;
+			return;
+		}
+
+		if (!load_huffman(j, ht_index, in + 1, nsymbols)) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+				"invalid DHT table %u (bad code lengths)\n", ht_index);
+			j->bad_tables = 1;
+			return;
+		}
+
+		in += 17 + nsymbols;
+	}
+}
+
+/* handle a marker segment other than SOS, 'in' points at its length */
+static void parse_segment(JPEGDecoder *j, uint8_t segment)
+{
+	switch (segment) {
+	case 0xd8:/*SOI*/
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "SOI\n");
+		j->current_segment_size = 0;
+		break;
+	case 0xe0:/*APP0*/
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "APP0\n");
+		break;
+	case 0xdb:/*DQT*/
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "DQT\n");
+		parse_dqt(j);
+		break;
+	case 0xc0:/*SOF0*/
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "SOF0\n");
+		parse_sof(j);
+		break;
+	case 0xc4:/*DHT*/
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "DHT\n");
+		parse_dht(j);
+		break;
+	case 0xdd:/*DRI*/
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "DRI\n");
+		parse_dri(j);
+		break;
+	case 0xd9:/*EOF*/
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "EOF\n");
+		break;
+	default:
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_WARNING, "unhandled segment\n");
+		break;
+	}
+}
+
+/* set up a decoder for one image, with the options applied */
+static int JPEGDecoder_init(JPEGDecoder *j, Image *image,
+	const JPEGDecoder_Options *options)
+{
+	unsigned i;
+
+	memset(j, 0, sizeof *j);
+	j->image = image;
+	j->log_level = JPEGDECODER_LOGLEVEL_FATAL;
+
+	/* until a DHT says otherwise, as motion JPEG frames rely on */
+	pthread_once(&huffman_cache_once, huffman_cache_init);
+	for (i = 0; i < 4; i++)
+		j->ht[i] = &huffman_cache[i].table;
+
+	j->output = options->output;
+	j->alpha = options->alpha;
+	j->buffer = options->buffer;
+	j->buffer_user = options->buffer_user;
+	j->index = options->index;
+	j->coefficients = options->coefficients;
+	j->dequantise = options->dequantise;
+	j->threads = options->threads;
+	j->pipeline_mode = options->pipeline;
+	j->rows = options->rows;
+	j->rows_user = options->rows_user;
+	j->strip = options->rows && options->strip && !options->buffer;
+	j->crop = options->crop_width != 0;
+	if (j->crop) {
+		j->crop_x = options->crop_x;
+		j->crop_y = options->crop_y;
+		j->crop_width = options->crop_width;
+		j->crop_height = options->crop_height;
+	}
+	if (!j->threads)
+		j->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (j->threads < 1)
+		j->threads = 1;
+
+	j->idct = JPEGIDCT_engine(options->idct);
+	if (!j->idct) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"IDCT '%s' not supported on this CPU\n",
+			JPEGDecoder_IDCT_name(options->idct));
+		return 0;
+	}
+
+	j->scale = options->scale ? options->scale : 1;
+	if (j->scale != 1 && j->scale != 2 && j->scale != 4 && j->scale != 8) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"scale 1/%u not supported\n", j->scale);
+		return 0;
+	}
+	j->block_size = 8 / j->scale;
+	/* the reduced size IDCTs take the islow table */
+	if (j->scale > 1 && options->idct == JPEGDECODER_IDCT_FLOAT)
+		j->idct = JPEGIDCT_engine(JPEGDECODER_IDCT_ISLOW);
+
+	JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO, "IDCT : %s\n", j->idct->name);
+	j->colour = JPEGColour_engine(options->idct);
+
+	if (j->output >= JPEGDECODER_OUTPUT_COUNT
+		|| ((j->output == JPEGDECODER_OUTPUT_I420
+			|| j->output == JPEGDECODER_OUTPUT_NV12)
+			&& (j->rows || j->buffer || j->crop))
+		|| (j->crop && !j->crop_height)
+		|| (j->coefficients
+			&& (j->scale > 1 || j->crop || j->rows || j->buffer))
+	) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+			"output %d not supported with these options\n", j->output);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void JPEGDecoder_destruct(JPEGDecoder *j)
+{
+	JPEGContext *context = j->context;
+
+	if (j->strip)
+		scratch_free(j, j->pixel_data_start);
+
+	if (!context) {
+		free(j->restart);
+		free(j->checkpoint);
+		return;
+	}
+
+	context->restart = j->restart;
+	context->restart_size = j->restart_size;
+	context->checkpoint = j->checkpoint;
+	context->checkpoint_size = j->checkpoint_size;
+
+	/* pixels the image was decoded into last time but no longer has */
+	if (context->output != j->image->data) {
+		free(context->output);
+		context->output = NULL;
+		context->output_size = 0;
+	}
+}
+
+void JPEGCoefficients_construct(JPEGCoefficients *this)
+{
+	memset(this, 0, sizeof *this);
+}
+
+void JPEGCoefficients_destruct(JPEGCoefficients *this)
+{
+	free(this->data);
+	JPEGCoefficients_construct(this);
+}
+
+void JPEGDecoder_Options_construct(JPEGDecoder_Options *this)
+{
+	memset(this, 0, sizeof *this);
+	this->idct = JPEGDECODER_IDCT_AUTO;
+	this->alpha = 255;
+	this->threads = 1;
+}
+
+Image_Result Image_read_format_memory_JPEG(
+	Image *image, uint8_t *start, uint8_t *end
+)
+{
+	return Image_read_format_memory_JPEG_options(image, start, end, NULL);
+}
+
+/* parse the marker segments of a file up to and including its scan */
+static void decode_segments(JPEGDecoder *j, const uint8_t *start,
+	const uint8_t *end)
+{
+	uint8_t segment;
+
+	j->in = start;
+
+	while (j->in + 3 < end) {
+		segment = j->in[1];
+		j->current_segment_size = 256*j->in[2] + j->in[3];
+
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
+			"%08x: segment:%02x size:%u\n",
+			(unsigned)(j->in - start),
+			(unsigned)segment, (unsigned)j->current_segment_size);
+
+		j->in += 2;
+
+		j->current_segment_start = j->in;
+		j->current_segment_end = j->in + j->current_segment_size;
+
+		switch (segment) {
+		case 0xda:/*SOS*/
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "SOS\n");
+
+			/* the scan is read as it is, up to the marker which ends it */
+			j->scan_start = j->current_segment_end;
+			j->scan_end = end;
+			parse_sos(j);
+			return;
+		default:
+			parse_segment(j, segment);
+			break;
+		}
+
+		j->in += j->current_segment_size;
+	}
+}
+
+static Image_Result read_memory(JPEGContext *context, Image *image,
+	const uint8_t *start, const uint8_t *end,
+	const JPEGDecoder_Options *options)
+{
+	JPEGDecoder j;
+	JPEGDecoder_Options default_options;
+	Image_Result image_result;
+#ifdef BENCHMARK
+	struct timeval tv_start, tv_end;
+	double tf_start, tf_end;
+#endif
+
+	if (!options) {
+		JPEGDecoder_Options_construct(&default_options);
+		options = &default_options;
+	}
+
+	if (!JPEGDecoder_init(&j, image, options))
+		return IMAGE_RESULT_FAILURE;
+
+	if (context) {
+		j.context = context;
+		j.restart = context->restart;
+		j.restart_size = context->restart_size;
+		j.checkpoint = context->checkpoint;
+		j.checkpoint_size = context->checkpoint_size;
+		/* only this image's own pixels can be reused */
+		if (image->data != context->output) {
+			context->output = NULL;
+			context->output_size = 0;
+		}
+	}
+
+#ifdef BENCHMARK
+	gettimeofday(&tv_start, NULL);
+#endif
+
+	decode_segments(&j, start, end);
+
+#ifdef BENCHMARK
+	gettimeofday(&tv_end, NULL);
+
+	tf_start = tv_start.tv_sec + tv_start.tv_usec/1000000.0;
+	tf_end = tv_end.tv_sec + tv_end.tv_usec/1000000.0;
+
+	j.log_level = JPEGDECODER_LOGLEVEL_FATAL;
+	JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_FATAL,
+		"decoded in %f s\n", tf_end - tf_start);
+#endif
+
+	/* no scan, or none that could be decoded : no SOF0 or SOS, an
+		unsupported frame, or the output couldn't be had */
+	image_result = j.decoded ? IMAGE_RESULT_SUCCESS : IMAGE_RESULT_FAILURE;
+	if (!j.decoded) {
+		JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_FATAL,
+			"no scan was decoded\n");
+	}
+
+	JPEGDecoder_destruct(&j);
+
+	return image_result;
+}
+
+Image_Result Image_read_format_memory_JPEG_options(
+	Image *image, uint8_t *start, uint8_t *end,
+	const JPEGDecoder_Options *options
+)
+{
+	return read_memory(NULL, image, start, end, options);
+}
+
+Image_Result Image_read_format_memory_JPEG_const(
+	Image *image, const uint8_t *start, const uint8_t *end,
+	const JPEGDecoder_Options *options
+)
+{
+	return read_memory(NULL, image, start, end, options);
+}
+
+/* the contents of 'file', mapped where possible : NULL on error */
+static const uint8_t *file_load(FILE *file, size_t *size, int *mapped)
+{
+	struct stat file_stat;
+	uint8_t *file_data;
+	void *mapping;
+
+	if (fstat(fileno(file), &file_stat) != 0)
+		return NULL;
+
+	*size = file_stat.st_size;
+
+	/* decode straight from the page cache where the file can be mapped */
+	mapping = *size
+		? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(file), 0)
+		: MAP_FAILED;
+	if (mapping != MAP_FAILED) {
+		madvise(mapping, *size, MADV_SEQUENTIAL);
+		*mapped = 1;
+		return (const uint8_t *)mapping;
+	}
+
+	*mapped = 0;
+	file_data = (uint8_t *)malloc(*size);
+	if (!file_data)
+		return NULL;
+
+	if (fread(file_data, *size, 1, file) != 1) {
+		free(file_data);
+		return NULL;
+	}
+
+	return file_data;
+}
+
+static void file_unload(const uint8_t *data, size_t size, int mapped)
+{
+	if (mapped)
+		munmap((void *)data, size);
+	else
+		free((void *)data);
+}
+
+static Image_Result read_file(JPEGContext *context, Image *image,
+	FILE *file, const JPEGDecoder_Options *options)
+{
+	const uint8_t *file_data;
+	size_t file_size;
+	int mapped;
+	Image_Result image_result;
+
+	file_data = file_load(file, &file_size, &mapped);
+	if (!file_data)
+		return IMAGE_RESULT_FAILURE;
+
+	image_result = read_memory(context, image, file_data,
+		file_data + file_size, options);
+
+	file_unload(file_data, file_size, mapped);
+	return image_result;
+}
+
+Image_Result Image_read_format_file_JPEG_options(
+	Image *image, FILE *file, const JPEGDecoder_Options *options)
+{
+	return read_file(NULL, image, file, options);
+}
+
+JPEGContext *JPEGContext_new(void)
+{
+	return (JPEGContext *)calloc(1, sizeof(JPEGContext));
+}
+
+void JPEGContext_delete(JPEGContext *this)
+{
+	unsigned i;
+
+	if (!this)
+		return;
+	/* the output belongs to the image */
+	for (i = 0; i < JPEGSCRATCH_COUNT; i++)
+		free(this->scratch[i]);
+	free(this->restart);
+	free(this->checkpoint);
+	free(this);
+}
+
+Image_Result JPEGContext_read_memory(JPEGContext *this, Image *image,
+	const uint8_t *start, const uint8_t *end,
+	const JPEGDecoder_Options *options)
+{
+	return read_memory(this, image, start, end, options);
+}
+
+Image_Result JPEGContext_read_file(JPEGContext *this, Image *image,
+	FILE *file, const JPEGDecoder_Options *options)
+{
+	return read_file(this, image, file, options);
+}
+
+JPEGIndex *JPEGIndex_build(const uint8_t *start, const uint8_t *end,
+	unsigned interval)
+{
+	JPEGDecoder j;
+	JPEGDecoder_Options options;
+	JPEGIndex *index;
+	Image image;
+
+	index = (JPEGIndex *)calloc(1, sizeof *index);
+	if (!index)
+		return NULL;
+	index->interval = interval;
+
+	JPEGDecoder_Options_construct(&options);
+	Image_construct(&image);
+
+	if (JPEGDecoder_init(&j, &image, &options)) {
+		j.index_build = index;
+		decode_segments(&j, start, end);
+		JPEGDecoder_destruct(&j);
+	}
+
+	Image_destruct(&image);
+
+	if (!index->count) {
+		JPEGIndex_delete(index);
+		return NULL;
+	}
+	return index;
+}
+
+JPEGIndex *JPEGIndex_build_file(FILE *file, unsigned interval)
+{
+	const uint8_t *file_data;
+	size_t file_size;
+	int mapped;
+	JPEGIndex *index;
+
+	file_data = file_load(file, &file_size, &mapped);
+	if (!file_data)
+		return NULL;
+
+	index = JPEGIndex_build(file_data, file_data + file_size, interval);
+
+	file_unload(file_data, file_size, mapped);
+	return index;
+}
+
+void JPEGIndex_delete(JPEGIndex *this)
+{
+	if (!this)
+		return;
+	free(this->entry);
+	free(this);
+}
+
+/* sidecar files : "JPIX", the version and the header fields, then the
+	entries, all little endian */
+#define INDEX_MAGIC 0x5849504a
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 40
+#define INDEX_ENTRY_SIZE 34
+
+static void put_le(uint8_t *p, uint64_t v, unsigned n)
+{
+	for (; n; n--, v >>= 8)
+		*p++ = (uint8_t)v;
+}
+
+static uint64_t get_le(const uint8_t *p, unsigned n)
+{
+	uint64_t v = 0;
+
+	while (n--)
+		v = v << 8 | p[n];
+	return v;
+}
+
+Image_Result JPEGIndex_write(const JPEGIndex *this, FILE *file)
+{
+	uint8_t buffer[INDEX_HEADER_SIZE], *p;
+	const JPEGIndexEntry *e;
+	unsigned k, i;
+
+	put_le(buffer, INDEX_MAGIC, 4);
+	put_le(buffer + 4, INDEX_VERSION, 4);
+	put_le(buffer + 8, this->mcu_x, 4);
+	put_le(buffer + 12, this->mcu_y, 4);
+	put_le(buffer + 16, this->restart_interval, 4);
+	put_le(buffer + 20, this->scan_size, 8);
+	put_le(buffer + 28, this->scan_hash, 4);
+	put_le(buffer + 32, this->interval, 4);
+	put_le(buffer + 36, this->count, 4);
+	if (fwrite(buffer, INDEX_HEADER_SIZE, 1, file) != 1)
+		return IMAGE_RESULT_FAILURE;
+
+	for (k = 0; k < this->count; k++) {
+		e = &this->entry[k];
+		p = buffer;
+		put_le(p, e->mcu, 4);
+		put_le(p + 4, e->offset, 8);
+		put_le(p + 12, e->bits, 8);
+		p[20] = (uint8_t)e->count;
+		p[21] = (uint8_t)e->pad;
+		for (i = 0; i < 3; i++)
+			put_le(p + 22 + i*4, (uint32_t)e->dc[i], 4);
+		if (fwrite(buffer, INDEX_ENTRY_SIZE, 1, file) != 1)
+			return IMAGE_RESULT_FAILURE;
+	}
+
+	return IMAGE_RESULT_SUCCESS;
+}
+
+JPEGIndex *JPEGIndex_read(FILE *file)
+{
+	uint8_t buffer[INDEX_HEADER_SIZE], *p;
+	JPEGIndexEntry *e;
+	JPEGIndex *index;
+	unsigned k, i;
+
+	if (fread(buffer, INDEX_HEADER_SIZE, 1, file) != 1
+		|| get_le(buffer, 4) != INDEX_MAGIC
+		|| get_le(buffer + 4, 4) != INDEX_VERSION
+	) {
+		return NULL;
+	}
+
+	index = (JPEGIndex *)calloc(1, sizeof *index);
+	if (!index)
+		return NULL;
+
+	index->mcu_x = get_le(buffer + 8, 4);
+	index->mcu_y = get_le(buffer + 12, 4);
+	index->restart_interval = get_le(buffer + 16, 4);
+	index->scan_size = get_le(buffer + 20, 8);
+	index->scan_hash = get_le(buffer + 28, 4);
+	index->interval = get_le(buffer + 32, 4);
+	index->count = index->size = get_le(buffer + 36, 4);
+
+	/* no more entries than there are MCUs */
+	if (!index->count || index->count > index->mcu_x * index->mcu_y
+		|| !(index->entry = (JPEGIndexEntry *)malloc(
+			index->count * sizeof *index->entry))
+	) {
+		JPEGIndex_delete(index);
+		return NULL;
+	}
+
+	for (k = 0; k < index->count; k++) {
+		e = &index->entry[k];
+		p = buffer;
+		if (fread(buffer, INDEX_ENTRY_SIZE, 1, file) != 1) {
+			JPEGIndex_delete(index);
+			return NULL;
+		}
+		e->mcu = get_le(p, 4);
+		e->offset = get_le(p + 4, 8);
+		e->bits = get_le(p + 12, 8);
+		e->count = p[20];
+		e->pad = p[21];
+		for (i = 0; i < 3; i++)
+			e->dc[i] = (int32_t)get_le(p + 22 + i*4, 4);
+
+		/* entries have to be in order and point into the scan */
+		if ((k && e->mcu <= index->entry[k - 1].mcu)
+			|| e->mcu >= index->mcu_x * index->mcu_y
+			|| e->offset > index->scan_size || e->count > 64
+		) {
+			JPEGIndex_delete(index);
+			return NULL;
+		}
+	}
+
+	return index;
+}
+
+void JPEGStats_construct(JPEGStats *this)
+{
+	memset(this, 0, sizeof *this);
+	Image_construct(&this->dc);
+	Image_construct(&this->preview);
+}
+
+void JPEGStats_destruct(JPEGStats *this)
+{
+	Image_destruct(&this->dc);
+	Image_destruct(&this->preview);
+	JPEGStats_construct(this);
+}
+
+/* the preview, means and histogram from the DC planes of a finished decode */
+static Image_Result stats_compute(JPEGDecoder *j, JPEGStats *stats)
+{
+	const Image_Plane *plane = stats->dc.plane;
+	unsigned h[3], v[3], i, x, y;
+	uint64_t sum[3] = { 0, 0, 0 };
+	uint8_t *out;
+
+	Image_construct_size_channels(&stats->preview, j->width, j->height, 3);
+	if (!stats->preview.data)
+		return IMAGE_RESULT_FAILURE;
+
+	for (i = 0; i < j->components; i++) {
+		h[i] = j->mcu_size_x / j->block_size / j->component[i].sub_x;
+		v[i] = j->mcu_size_y / j->block_size / j->component[i].sub_y;
+	}
+
+	for (y = 0; y < j->height; y++) {
+		out = stats->preview.data + (size_t)y * j->width * 3;
+		if (j->components == 1) {
+			JPEGColour_scalar.row[JPEGDECODER_OUTPUT_BGR][2](
+				plane[0].data + y * plane[0].stride, NULL, NULL,
+				out, j->width, 255);
+		} else {
+			JPEGColour_row(plane[0].data + y / v[0] * plane[0].stride,
+				plane[1].data + y / v[1] * plane[1].stride,
+				plane[2].data + y / v[2] * plane[2].stride, h,
+				out, j->width, JPEGDECODER_OUTPUT_BGR, 255);
+		}
+		for (x = 0; x < j->width; x++, out += 3) {
+			sum[0] += out[0];
+			sum[1] += out[1];
+			sum[2] += out[2];
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+		stats->mean[i] = (double)sum[i] / ((double)j->width * j->height);
+
+	for (y = 0; y < plane[0].size_y; y++)
+		for (x = 0; x < plane[0].size_x; x++)
+			stats->histogram[plane[0].data[y * plane[0].stride + x]]++;
+
+	return IMAGE_RESULT_SUCCESS;
+}
+
+Image_Result JPEGStats_read_memory(JPEGStats *this, const uint8_t *start,
+	const uint8_t *end, const JPEGDecoder_Options *options)
+{
+	JPEGDecoder j;
+	JPEGDecoder_Options dc_options;
+	Image_Result result = IMAGE_RESULT_FAILURE;
+
+	JPEGStats_destruct(this);
+
+	/* at 1/8 with no colour conversion every component's blocks are
+		reduced to their DC, one sample each */
+	JPEGDecoder_Options_construct(&dc_options);
+	if (options) {
+		dc_options.idct = options->idct;
+		dc_options.index = options->index;
+		dc_options.threads = options->threads;
+		dc_options.pipeline = options->pipeline;
+	}
+	dc_options.output = JPEGDECODER_OUTPUT_I420;
+	dc_options.scale = 8;
+
+	if (!JPEGDecoder_init(&j, &this->dc, &dc_options))
+		return IMAGE_RESULT_FAILURE;
+
+	decode_segments(&j, start, end);
+	/* the DC image is allocated at SOF, before the scan that fills it */
+	if (j.decoded && this->dc.data)
+		result = stats_compute(&j, this);
+	else
+		JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_FATAL,
+			"no scan was decoded\n");
+
+	JPEGDecoder_destruct(&j);
+	return result;
+}
+
+Image_Result JPEGStats_read_file(JPEGStats *this, FILE *file,
+	const JPEGDecoder_Options *options)
+{
+	const uint8_t *file_data;
+	size_t file_size;
+	int mapped;
+	Image_Result result;
+
+	file_data = file_load(file, &file_size, &mapped);
+	if (!file_data)
+		return IMAGE_RESULT_FAILURE;
+
+	result = JPEGStats_read_memory(this, file_data, file_data + file_size,
+		options);
+
+	file_unload(file_data, file_size, mapped);
+	return result;
+}
+
+/* header probing : just enough of the marker segments to describe a file */
+
+/* most that JPEGInfo_read_file reads of a segment */
+#define INFO_SEGMENT_SIZE 4096
+
+/* the TIFF structure of an EXIF APP1 segment */
+typedef struct JPEGExif_t {
+	const uint8_t *tiff;
+	size_t size;
+	int big_endian;
+} JPEGExif;
+
+/* 0 unless 'data' is the contents of an EXIF APP1 segment */
+static int exif_open(JPEGExif *exif, const uint8_t *data, size_t size)
+{
+	if (size < 14 || memcmp(data, "Exif\0\0", 6) != 0)
+		return 0;
+
+	exif->tiff = data + 6;
+	exif->size = size - 6;
+	if (memcmp(exif->tiff, "II*\0", 4) == 0)
+		exif->big_endian = 0;
+	else if (memcmp(exif->tiff, "MM\0*", 4) == 0)
+		exif->big_endian = 1;
+	else
+		return 0;
+
+	return 1;
+}
+
+/* 'n' (2 or 4) byte number at 'offset' into the TIFF data, 0 past its end */
+static uint32_t exif_get(const JPEGExif *exif, size_t offset, unsigned n)
+{
+	uint32_t value = 0;
+	unsigned i;
+
+	if (offset > exif->size || exif->size - offset < n)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		value |= (uint32_t)exif->tiff[offset + i]
+			<< 8 * (exif->big_endian ? n - 1 - i : i);
+	}
+	return value;
+}
+
+/* value of SHORT or LONG tag 'tag' in the IFD at 'ifd', 0 if it isn't
+	there */
+static uint32_t exif_tag(const JPEGExif *exif, size_t ifd, unsigned tag)
+{
+	unsigned i, count;
+	size_t entry;
+
+	count = exif_get(exif, ifd, 2);
+	for (i = 0; i < count; i++) {
+		entry = ifd + 2 + 12 * (size_t)i;
+		if (exif_get(exif, entry, 2) == tag) {
+			return exif_get(exif, entry + 8,
+				exif_get(exif, entry + 2, 2) == 3 /* SHORT */ ? 2 : 4);
+		}
+	}
+
+	return 0;
+}
+
+/* offset into the TIFF data of the JPEG thumbnail described by IFD1, and
+	its size; 0 if there isn't one lying within the first 'limit' bytes */
+static size_t exif_thumbnail(const JPEGExif *exif, size_t limit,
+	size_t *size)
+{
+	size_t ifd0, ifd1, offset;
+
+	/* IFD1 follows on from IFD0's entries */
+	ifd0 = exif_get(exif, 4, 4);
+	ifd1 = exif_get(exif, ifd0 + 2 + 12 * (size_t)exif_get(exif, ifd0, 2), 4);
+	if (!ifd1)
+		return 0;
+
+	offset = exif_tag(exif, ifd1, 0x201); /* JPEGInterchangeFormat */
+	*size = exif_tag(exif, ifd1, 0x202); /* JPEGInterchangeFormatLength */
+	if (!offset || *size < 4 || offset > limit || limit - offset < *size)
+		return 0;
+	return offset;
+}
+
+/* SOFn, rather than DHT, JPG or DAC which share the range */
+static int is_sof(unsigned marker)
+{
+	return marker >= 0xc0 && marker <= 0xcf
+		&& marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+/* segments whose contents info_segment looks at */
+static int info_wants(unsigned marker)
+{
+	return is_sof(marker) || marker == 0xdd /*DRI*/ || marker == 0xe1 /*APP1*/;
+}
+
+/* take what is wanted from a segment, of whose contents 'size' bytes (maybe
+	not all of them) are in 'data'.  The contents start 'offset' bytes into
+	the file and are 'total' bytes long.  0 at the end of the headers. */
+static int info_segment(JPEGInfo *info, unsigned marker, const uint8_t *data,
+	size_t size, size_t offset, size_t total)
+{
+	JPEGExif exif;
+	size_t thumbnail;
+	unsigned i;
+
+	if (marker == 0xda /*SOS*/ || marker == 0xd9 /*EOI*/)
+		return 0;
+
+	if (is_sof(marker) && size >= 6 && !info->sof) {
+		info->sof = marker;
+		info->precision = data[0];
+		info->height = 256*data[1] + data[2];
+		info->width = 256*data[3] + data[4];
+		info->components = data[5];
+		for (i = 0; i < info->components && i < 4 && 8 + 3*i <= size; i++) {
+			info->id[i] = data[6 + 3*i];
+			info->sub_x[i] = data[7 + 3*i] >> 4;
+			info->sub_y[i] = data[7 + 3*i] & 15;
+		}
+		info->progressive = (marker & 3) == 2;
+		info->arithmetic = marker > 0xc8;
+	} else if (marker == 0xdd && size >= 2) {
+		info->restart_interval = 256*data[0] + data[1];
+	} else if (marker == 0xe1 && !info->exif
+		&& exif_open(&exif, data, size)
+	) {
+		info->exif = 1;
+		info->orientation = exif_tag(&exif, exif_get(&exif, 4, 4), 0x112);
+		if (info->orientation > 8)
+			info->orientation = 0;
+		thumbnail = exif_thumbnail(&exif, total - 6,
+			&info->thumbnail_size);
+		if (thumbnail)
+			info->thumbnail_offset = offset + 6 + thumbnail;
+		else
+			info->thumbnail_size = 0;
+	}
+
+	return 1;
+}
+
+/* fails without a SOF; otherwise works out, as parse_sof and start_scan
+	would, whether the file can be decoded */
+static Image_Result info_finish(JPEGInfo *info)
+{
+	unsigned i, sub_x[3] = { 0, 0, 0 }, sub_y[3] = { 0, 0, 0 }, blocks = 0;
+
+	if (!info->sof)
+		return IMAGE_RESULT_FAILURE;
+
+	/* only SOF0 frames are parsed : SOF1 can have 12-bit samples and more
+		tables than the decoder keeps */
+	info->supported = info->sof == 0xc0
+		&& info->precision == 8
+		&& (info->components == 1 || info->components == 3)
+		&& info->width && info->height;
+	if (!info->supported)
+		return IMAGE_RESULT_SUCCESS;
+
+	/* components by identifier, 1 to 3, as parse_sof has them */
+	for (i = 0; i < info->components; i++) {
+		if (info->id[i] < 1 || info->id[i] > 3) {
+			info->supported = 0;
+			return IMAGE_RESULT_SUCCESS;
+		}
+		sub_x[info->id[i] - 1] = info->sub_x[i];
+		sub_y[info->id[i] - 1] = info->sub_y[i];
+	}
+
+	/* a single component is one block per MCU whatever it says */
+	if (info->components == 1)
+		return IMAGE_RESULT_SUCCESS;
+	for (i = 0; i < 3; i++) {
+		if (!sub_x[i] || sub_x[i] > 2 || !sub_y[i] || sub_y[i] > 2)
+			info->supported = 0;
+		blocks += sub_x[i] * sub_y[i];
+	}
+	if (blocks > 10)
+		info->supported = 0;
+
+	return IMAGE_RESULT_SUCCESS;
+}
+
+Image_Result JPEGInfo_read_memory(JPEGInfo *this, const uint8_t *start,
+	const uint8_t *end)
+{
+	const uint8_t *in = start + 2;
+	size_t size;
+
+	memset(this, 0, sizeof *this);
+	if (end - start < 2 || start[0] != 0xff || start[1] != 0xd8)
+		return IMAGE_RESULT_FAILURE;
+
+	while (end - in >= 4 && in[0] == 0xff) {
+		if (in[1] == 0xff) {
+			/* fill byte */
+			in++;
+			continue;
+		}
+		size = 256*in[2] + in[3];
+		if (size < 2)
 			break;
-		case 0xda:/*SOS*/
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_DEBUG, "SOS\n");
-
-			scan_in = scan_out = j.current_segment_end;
-
-			while (scan_in < end) {
-				if (scan_in[0] == 0xff) {
-					if (scan_in[1] == 0) {
-						*scan_out++ = 0xff;
-						scan_in += 2;
-					} else {
-						/* found another marker */
-						break;
-					}
-				} else {
-					*scan_out++ = *scan_in++;
-				}
-			}
+		size -= 2;
+		if ((size_t)(end - (in + 4)) < size)
+			size = end - (in + 4);
+		if (!info_segment(this, in[1], in + 4, size, in + 4 - start, size))
+			break;
+		in += 4 + size;
+	}
 
-			if (scan_in == end) {
-				JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_FATAL,
-					"decode: reached end of file while scanning SOS segment\n");
-			}
+	return info_finish(this);
+}
+
+/* move on 'size' bytes, reading through them if the file can't seek */
+static int file_skip(FILE *file, size_t size, uint8_t *buffer,
+	size_t buffer_size)
+{
+	size_t n;
+
+	if (size <= LONG_MAX && fseek(file, (long)size, SEEK_CUR) == 0)
+		return 1;
+
+	for (; size; size -= n) {
+		n = size < buffer_size ? size : buffer_size;
+		if (fread(buffer, n, 1, file) != 1)
+			return 0;
+	}
+	return 1;
+}
 
-			parse_sos(&j);
-			goto done;
+Image_Result JPEGInfo_read_file(JPEGInfo *this, FILE *file)
+{
+	uint8_t buffer[INFO_SEGMENT_SIZE];
+	int marker;
+	size_t size, n;
+	size_t offset = 2; /* bytes read so far */
+
+	memset(this, 0, sizeof *this);
+	if (fgetc(file) != 0xff || fgetc(file) != 0xd8)
+		return IMAGE_RESULT_FAILURE;
+
+	while (fgetc(file) == 0xff) {
+		for (offset += 2; (marker = fgetc(file)) == 0xff; offset++);
+		if (marker == EOF || fread(buffer, 2, 1, file) != 1)
 			break;
-		case 0xd9:/*EOF*/
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_DEBUG, "EOF\n");
+		size = 256*buffer[0] + buffer[1];
+		if (size < 2)
 			break;
-		default:
-			JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_WARNING, "unhandled segment\n");
+		size -= 2;
+		offset += 2;
+
+		/* only segments which are looked at are read, and only their start */
+		n = 0;
+		if (info_wants(marker))
+			n = size < sizeof buffer ? size : sizeof buffer;
+		if (n && fread(buffer, n, 1, file) != 1)
+			break;
+		if (!info_segment(this, marker, buffer, n, offset, size)
+			|| !file_skip(file, size - n, buffer, sizeof buffer)
+		) {
+			break;
+		}
+		offset += size;
+	}
+
+	return info_finish(this);
+}
+
+/* smallest of 1/8, 1/4, 1/2 or full size at which the image described by
+	'info' is at least 'width' x 'height' */
+static unsigned thumbnail_scale(const JPEGInfo *info, unsigned width,
+	unsigned height)
+{
+	unsigned scale;
+
+	for (scale = 8; scale > 1; scale /= 2) {
+		if ((info->width + scale - 1) / scale >= width
+			&& (info->height + scale - 1) / scale >= height
+		) {
+			break;
+		}
+	}
+	return scale;
+}
+
+Image_Result JPEGThumbnail_read_memory(Image *image, const uint8_t *start,
+	const uint8_t *end, unsigned width, unsigned height,
+	const JPEGDecoder_Options *options)
+{
+	JPEGDecoder_Options thumbnail_options;
+	JPEGInfo info, thumbnail;
+	const uint8_t *data;
+
+	if (!JPEGInfo_read_memory(&info, start, end))
+		return IMAGE_RESULT_FAILURE;
+
+	if (options)
+		thumbnail_options = *options;
+	else
+		JPEGDecoder_Options_construct(&thumbnail_options);
+	thumbnail_options.crop_width = thumbnail_options.crop_height = 0;
+
+	/* the thumbnail goes through the same decoder, as a file of its own.
+		If it turns out not to decode, the image itself is decoded instead. */
+	if (info.thumbnail_size) {
+		data = start + info.thumbnail_offset;
+		if (JPEGInfo_read_memory(&thumbnail, data, data + info.thumbnail_size)
+			&& thumbnail.supported
+			&& thumbnail.width >= width && thumbnail.height >= height
+		) {
+			thumbnail_options.scale = thumbnail_scale(&thumbnail, width, height);
+			if (read_memory(NULL, image, data, data + info.thumbnail_size,
+					&thumbnail_options)
+				&& (image->data || thumbnail_options.buffer
+					|| thumbnail_options.strip)
+			) {
+				return IMAGE_RESULT_SUCCESS;
+			}
+		}
+	}
+
+	thumbnail_options.scale = thumbnail_scale(&info, width, height);
+	return read_memory(NULL, image, start, end, &thumbnail_options);
+}
+
+Image_Result JPEGThumbnail_read_file(Image *image, FILE *file,
+	unsigned width, unsigned height, const JPEGDecoder_Options *options)
+{
+	const uint8_t *file_data;
+	size_t file_size;
+	int mapped;
+	Image_Result result;
+
+	file_data = file_load(file, &file_size, &mapped);
+	if (!file_data)
+		return IMAGE_RESULT_FAILURE;
+
+	result = JPEGThumbnail_read_memory(image, file_data,
+		file_data + file_size, width, height, options);
+
+	file_unload(file_data, file_size, mapped);
+	return result;
+}
+
+/* incremental decoding : pushed bytes collect in 'raw' until a whole marker
+	segment is there to parse.  Once the scan starts each MCU row is decoded
+	when the reader gets through it without running out of data; otherwise it
+	is tried again from the same cursor after the next push. */
+
+typedef enum JPEGStream_State_t {
+	JPEGSTREAM_HEADERS,
+	JPEGSTREAM_SCAN,
+	JPEGSTREAM_DONE,
+	JPEGSTREAM_ERROR
+} JPEGStream_State;
+
+struct JPEGStream_t {
+	JPEGDecoder j;
+	JPEGStream_State state;
+	/* pushed bytes, those before 'raw_start' have been consumed.  In the scan
+		the next MCU row's data starts at 'raw_start'. */
+	uint8_t *raw;
+	size_t raw_start, raw_end, raw_size;
+	size_t scan_checked; /* the scan has been searched for its end to here */
+	int scan_complete; /* its end marker, or the end of input, was reached */
+	/* reader and DC predictors at the start of the next MCU row */
+	JPEGCheckpoint cursor;
+	unsigned row;
+	/* after a row ran out of data, don't try it again until 'raw_end' gets
+		here, so that tiny pushes don't decode the same row over and over */
+	size_t retry_at;
+	int16_t *coef; /* coefficients of one MCU row */
+	uint8_t *support; /* and the support of each of its blocks */
+};
+
+/* make room for 'need' bytes in a growing buffer */
+static int stream_reserve(uint8_t **buffer, size_t *size, size_t need)
+{
+	uint8_t *p;
+	size_t n;
+
+	if (need <= *size)
+		return 1;
+
+	for (n = *size ? *size : 4096; n < need; n *= 2);
+
+	p = (uint8_t *)realloc(*buffer, n);
+	if (!p)
+		return 0;
+	*buffer = p;
+	*size = n;
+	return 1;
+}
+
+static int stream_start_scan(JPEGStream *s)
+{
+	JPEGDecoder *j = &s->j;
+
+	if (!start_scan(j))
+		return 0;
+
+	s->coef = (int16_t *)calloc(j->mcu_x * j->blocks_per_mcu * 64,
+		sizeof *s->coef);
+	s->support = (uint8_t *)malloc(j->mcu_x * j->blocks_per_mcu);
+	if (!s->coef || !s->support)
+		return 0;
+
+	memset(&s->cursor, 0, sizeof s->cursor);
+	s->scan_checked = s->raw_start;
+	s->state = JPEGSTREAM_SCAN;
+	return 1;
+}
+
+/* parse the marker segments which are complete, 1 on reaching the scan, 0 if
+	more data is needed and -1 on error */
+static int stream_headers(JPEGStream *s)
+{
+	JPEGDecoder *j = &s->j;
+	uint8_t *p, segment;
+	size_t avail, size;
+
+	for (;;) {
+		p = s->raw + s->raw_start;
+		avail = s->raw_end - s->raw_start;
+		if (avail < 2)
+			return 0;
+
+		if (p[0] != 0xff) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL,
+				"expected a marker, found %02x\n", (unsigned)p[0]);
+			return -1;
+		}
+
+		segment = p[1];
+		if (segment == 0xff) {
+			/* fill byte */
+			s->raw_start++;
+			continue;
+		}
+
+		if (segment == 0xd8 || (segment >= 0xd0 && segment <= 0xd7)) {
+			/* SOI, stray RSTn : no length */
+			s->raw_start += 2;
+			continue;
+		}
+
+		if (segment == 0xd9) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_FATAL, "EOI before a scan\n");
+			return -1;
+		}
+
+		if (avail < 4)
+			return 0;
+		size = 256*p[2] + p[3];
+		if (avail < 2 + size)
+			return 0;
+
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_INFO,
+			"segment:%02x size:%u\n", (unsigned)segment, (unsigned)size);
+
+		j->in = p + 2;
+		j->current_segment_size = size;
+		j->current_segment_start = j->in;
+		j->current_segment_end = j->in + size;
+		s->raw_start += 2 + size;
+
+		if (segment == 0xda) {
+			JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "SOS\n");
+			return stream_start_scan(s) ? 1 : -1;
+		}
+
+		parse_segment(j, segment);
+	}
+}
+
+/* look through the newly pushed part of the scan for the marker which ends
+	it, a trailing 0xff is looked at again once the next byte is in */
+static void stream_find_end(JPEGStream *s)
+{
+	const uint8_t *in, *end;
+
+	in = s->raw + s->scan_checked;
+	end = s->raw + s->raw_end;
+
+	while ((in = (const uint8_t *)memchr(in, 0xff, end - in)) && end - in >= 2) {
+		if (in[1] == 0 || (in[1] >= 0xd0 && in[1] <= 0xd7)) {
+			in += 2;
+		} else if (in[1] == 0xff) {
+			in++;
+		} else {
+			s->scan_complete = 1;
 			break;
 		}
+	}
+
+	s->scan_checked = (in ? in : end) - s->raw;
+}
+
+/* decode the next MCU row if all of its data is in, 0 if not (yet) */
+static int stream_decode_row(JPEGStream *s)
+{
+	JPEGDecoder *j = &s->j;
+	JPEGCheckpoint c = s->cursor;
+	const uint8_t *end = s->raw + s->raw_end;
+	unsigned ix;
+	size_t avail, mcu_coef = j->blocks_per_mcu * 64;
+
+	c.b.in = s->raw + s->raw_start;
+	c.b.end = end;
+
+	for (ix = 0; ix < j->mcu_x; ix++, c.mcu++) {
+		if (!checkpoint_restart(j, &c, 0) && !s->scan_complete) {
+			/* the RSTn isn't in yet */
+			s->retry_at = s->raw_end + 1;
+			memset(s->coef, 0, ix * mcu_coef * sizeof *s->coef);
+			return 0;
+		}
 
-		if (scan_in)
-			j.in = scan_in;
+		if (s->row >= j->mcu_y0)
+			decode_mcu_window(j, &c.b, c.dc, s->coef + ix * mcu_coef,
+				s->support + ix * j->blocks_per_mcu, ix);
 		else
-			j.in += j.current_segment_size;
+			skip_mcu(j, &c.b, c.dc);
+
+		/* the reader stopping at a marker is the end of the interval, at the
+			end of what has been pushed it has to wait for more */
+		if (!s->scan_complete && bitreader_overrun(&c.b) && end - c.b.in < 2) {
+			/* going by how far the row got, guess how much it needs */
+			avail = s->raw_end - s->raw_start;
+			s->retry_at = s->raw_start + avail * j->mcu_x / (ix + 1);
+			if (s->retry_at > s->raw_end + avail)
+				s->retry_at = s->raw_end + avail;
+			if (s->retry_at <= s->raw_end + avail / 8)
+				s->retry_at = s->raw_end + avail / 8 + 1;
+			/* the row is decoded again from the start */
+			memset(s->coef, 0, (ix + 1) * mcu_coef * sizeof *s->coef);
+			return 0;
+		}
 	}
 
-done:
+	if (s->row >= j->mcu_y0)
+		reconstruct_row(j, s->coef, s->support, s->row);
 
-#ifdef BENCHMARK
-	i = gettimeofday(&tv_end, NULL);
+	bitreader_unpad(&c.b);
+	s->cursor = c;
+	s->raw_start = c.b.in - s->raw;
 
-	tf_start = tv_start.tv_sec + tv_start.tv_usec/1000000.0;
-	tf_end = tv_end.tv_sec + tv_end.tv_usec/1000000.0;
+	emit_rows(j, s->row++);
+	return 1;
+}
 
-	j.log_level = JPEGDECODER_LOGLEVEL_FATAL;
-	JPEGDecoder_log(&j, JPEGDECODER_LOGLEVEL_FATAL,
-		"decoded in %f s\n", tf_end - tf_start);
-#endif
+/* take in as much of the pushed data as possible, 0 on error */
+static int stream_process(JPEGStream *s)
+{
+	JPEGDecoder *j = &s->j;
+	int r;
 
-	for (i=0; i<4; i++)
-		free(j.ht[i]);
+	if (s->state == JPEGSTREAM_HEADERS) {
+		r = stream_headers(s);
+		if (r <= 0)
+			return r == 0;
+	}
 
-	return image_result;
+	if (s->state != JPEGSTREAM_SCAN)
+		return 1;
+
+	if (!s->scan_complete)
+		stream_find_end(s);
+
+	/* rows after the output window are never decoded */
+	while (s->row < j->mcu_y1
+		&& (s->scan_complete || s->raw_end >= s->retry_at)
+		&& stream_decode_row(s));
+
+	if (s->row == j->mcu_y1) {
+		JPEGDecoder_log(j, JPEGDECODER_LOGLEVEL_DEBUG, "scan decoded\n");
+		s->state = JPEGSTREAM_DONE;
+	}
+
+	return 1;
+}
+
+JPEGStream *JPEGStream_new(Image *image, const JPEGDecoder_Options *options)
+{
+	JPEGStream *this;
+	JPEGDecoder_Options default_options;
+
+	if (!options) {
+		JPEGDecoder_Options_construct(&default_options);
+		options = &default_options;
+	}
+
+	this = (JPEGStream *)calloc(1, sizeof *this);
+	if (!this)
+		return NULL;
+
+	if (!JPEGDecoder_init(&this->j, image, options)) {
+		free(this);
+		return NULL;
+	}
+
+	this->state = JPEGSTREAM_HEADERS;
+	return this;
+}
+
+void JPEGStream_delete(JPEGStream *this)
+{
+	if (!this)
+		return;
+	JPEGDecoder_destruct(&this->j);
+	free(this->raw);
+	free(this->coef);
+	free(this->support);
+	free(this);
 }
 
+Image_Result JPEGStream_push(JPEGStream *this, const uint8_t *data,
+	size_t size)
+{
+	size_t n;
+
+	if (this->state == JPEGSTREAM_ERROR)
+		return IMAGE_RESULT_FAILURE;
+	if (this->state == JPEGSTREAM_DONE)
+		return IMAGE_RESULT_SUCCESS;
+
+	/* once at least half has been consumed, move the rest to the front */
+	n = this->raw_start;
+	if (n && n >= this->raw_end - n) {
+		memmove(this->raw, this->raw + n, this->raw_end - n);
+		this->raw_end -= n;
+		this->raw_start = 0;
+		this->scan_checked -= n < this->scan_checked ? n : this->scan_checked;
+		this->retry_at -= n < this->retry_at ? n : this->retry_at;
+	}
+
+	if (!stream_reserve(&this->raw, &this->raw_size, this->raw_end + size)) {
+		this->state = JPEGSTREAM_ERROR;
+		return IMAGE_RESULT_FAILURE;
+	}
+	memcpy(this->raw + this->raw_end, data, size);
+	this->raw_end += size;
+
+	if (!stream_process(this)) {
+		this->state = JPEGSTREAM_ERROR;
+		return IMAGE_RESULT_FAILURE;
+	}
+	return IMAGE_RESULT_SUCCESS;
+}
+
+Image_Result JPEGStream_finish(JPEGStream *this)
+{
+	if (this->state == JPEGSTREAM_SCAN) {
+		if (!this->scan_complete) {
+			JPEGDecoder_log(&this->j, JPEGDECODER_LOGLEVEL_WARNING,
+				"input ended in the scan\n");
+			this->scan_complete = 1;
+		}
+		if (!stream_process(this))
+			this->state = JPEGSTREAM_ERROR;
+	}
+
+	return this->state == JPEGSTREAM_DONE
+		? IMAGE_RESULT_SUCCESS : IMAGE_RESULT_FAILURE;
+}
+
+int JPEGStream_done(const JPEGStream *this)
+{
+	return this->state == JPEGSTREAM_DONE;
+}
@@ -1 +1,258 @@
+#ifndef INCLUDE_JPEGDECODER_H
+#define INCLUDE_JPEGDECODER_H
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+/* IDCT used to reconstruct samples */
+typedef enum JPEGDecoder_IDCT_t {
+	JPEGDECODER_IDCT_AUTO, /* fastest engine this CPU supports */
+	JPEGDECODER_IDCT_ISLOW, /* accurate integer, bit-exact with libjpeg JDCT_ISLOW */
+	JPEGDECODER_IDCT_FLOAT, /* float AAN */
+	JPEGDECODER_IDCT_SSE2, /* ISLOW with SSE2 */
+	JPEGDECODER_IDCT_AVX2, /* ISLOW with AVX2 */
+	JPEGDECODER_IDCT_COUNT
+} JPEGDecoder_IDCT;
+
+/* what the decoded pixels are written as */
+typedef enum JPEGDecoder_Output_t {
+	JPEGDECODER_OUTPUT_BGR, /* interleaved, colour converted */
+	/* no colour conversion : the IDCT output goes straight into Image.plane,
+		Y then Cb then Cr, each at the file's own resolution (I420 for 4:2:0,
+		I422 or I444 for other files, just Y for greyscale) */
+	JPEGDECODER_OUTPUT_I420,
+	/* as I420 but with Cb and Cr sharing one plane, interleaved (NV12 for
+		4:2:0). Cb and Cr must be sampled alike, so not greyscale. */
+	JPEGDECODER_OUTPUT_NV12,
+	JPEGDECODER_OUTPUT_RGB,
+	JPEGDECODER_OUTPUT_BGRA, /* alpha is JPEGDecoder_Options.alpha */
+	JPEGDECODER_OUTPUT_RGBA,
+	JPEGDECODER_OUTPUT_RGB565, /* 16-bit little endian, red at the top */
+	JPEGDECODER_OUTPUT_COUNT
+} JPEGDecoder_Output;
+
+/* rows [y, y + count) of the image are complete.  'rows' points at the first
+	of them, the next ones follow 'stride' bytes apart, laid out as in Image */
+typedef void (*JPEGDecoder_RowsCallback)(void *user, const uint8_t *rows,
+	size_t stride, unsigned y, unsigned count);
+
+/* the image is 'width' x 'height' : return where to decode it to, rows of
+	exactly 'width' pixels in the output format, setting '*stride' to the
+	bytes from one row to the next.  NULL gives up on the image. */
+typedef uint8_t *(*JPEGDecoder_BufferCallback)(void *user, unsigned width,
+	unsigned height, size_t *stride);
+
+/* DCT coefficients of one component : blocks_x x blocks_y blocks, covering
+	whole MCUs so there may be some past the edge of the image, of 64
+	coefficients each in natural (row major) order.  'qt' is the component's
+	quantisation table, in the same order. */
+typedef struct JPEGCoefficients_Component_t {
+	unsigned sub_x, sub_y;
+	unsigned blocks_x, blocks_y;
+	int16_t *coef;
+	uint16_t qt[64];
+} JPEGCoefficients_Component;
+
+typedef struct JPEGCoefficients_t {
+	unsigned width, height, components;
+	/* multiplied out by the quantisation tables (saturated to 16 bits),
+		rather than as they are in the file */
+	int dequantised;
+	JPEGCoefficients_Component component[3];
+	int16_t *data; /* all the components' coefficients */
+} JPEGCoefficients;
+
+void JPEGCoefficients_construct(JPEGCoefficients *this);
+void JPEGCoefficients_destruct(JPEGCoefficients *this);
+
+/* seek index of a file : the entropy decoder's state every so many MCUs,
+	from which decoding can start without reading the scan before it */
+typedef struct JPEGIndex_t JPEGIndex;
+
+typedef struct JPEGDecoder_Options_t {
+	JPEGDecoder_IDCT idct;
+	/* planar output can't be combined with 'rows' or 'buffer' */
+	JPEGDecoder_Output output;
+	uint8_t alpha; /* for BGRA and RGBA */
+	/* 1 (or 0), 2, 4 or 8 : decode at 1/scale of the size, rounded up, by
+		reducing each 8x8 block to 4x4, 2x2 or just its DC term in the IDCT.
+		The float IDCT is replaced by islow when scaling. */
+	unsigned scale;
+	/* if crop_width is set, decode only the crop_width x crop_height pixels
+		at (crop_x, crop_y) of the (scaled) image, clipped to it.  'image' is
+		the size of the crop; MCUs outside it are only entropy decoded, and
+		decoding stops after the last MCU row it needs.  Packed output only. */
+	unsigned crop_x, crop_y, crop_width, crop_height;
+	/* if set, an index of this file from JPEGIndex_build : with a crop each
+		of its MCU rows is decoded from the nearest entry before it rather
+		than from wherever the previous one ended, and threads start from the
+		entries without a pass over the scan to find their own.  An index
+		of some other file is ignored. */
+	const JPEGIndex *index;
+	/* if set, decode to DCT coefficients instead of pixels, with no IDCT or
+		colour conversion at all; 'dequantise' multiplies them out by the
+		quantisation tables.  'image' gets the size but no data.  Can't be
+		combined with 'scale', a crop, 'rows' or 'buffer'. */
+	JPEGCoefficients *coefficients;
+	int dequantise;
+	/* if set, decode into the caller's memory instead of allocating the
+		image, e.g. straight into a framebuffer or a shared memory segment.
+		'image' gets the size but no data. */
+	JPEGDecoder_BufferCallback buffer;
+	void *buffer_user;
+	/* threads decoding a scan, 0 for one per online CPU.  Restart intervals
+		(DRI/RSTn) are independent, so they are shared out between threads;
+		without them a quick entropy-only pass first finds where each MCU row
+		starts and the rows are shared out instead */
+	unsigned threads;
+	/* with more than one thread, entropy decode MCU rows on the calling thread
+		into a small ring buffer while the other threads IDCT and colour
+		convert finished rows, rather than splitting the scan up front */
+	int pipeline;
+	/* if set, called with bands of finished rows in order from the top : each
+		MCU row as it is done when decoding on one thread, otherwise the whole
+		image at the end */
+	JPEGDecoder_RowsCallback rows;
+	void *rows_user;
+	/* with 'rows' and without 'buffer', don't allocate the image : rows are decoded on the calling
+		thread into a buffer of one MCU row (8 or 16 pixel rows) and are only
+		valid during the callback.  'image' gets the size but no data. */
+	int strip;
+} JPEGDecoder_Options;
+
+void JPEGDecoder_Options_construct(JPEGDecoder_Options *this);
+
+/* engine picked by JPEGDECODER_IDCT_AUTO, from cpuid */
+JPEGDecoder_IDCT JPEGDecoder_IDCT_best(void);
+int JPEGDecoder_IDCT_supported(JPEGDecoder_IDCT idct);
+const char *JPEGDecoder_IDCT_name(JPEGDecoder_IDCT idct);
+JPEGDecoder_IDCT JPEGDecoder_IDCT_from_name(const char *name);
+
+/* as Image_read_format_memory_JPEG / Image_read_format_file_JPEG, options may
+	be NULL for the defaults */
+Image_Result Image_read_format_memory_JPEG_options(Image *image,
+	uint8_t *start, uint8_t *end, const JPEGDecoder_Options *options);
+/* the input is never written to, so a read-only mapping or a buffer shared
+	by concurrent decoders can be used; this variant just takes it as const.
+	Files are read through mmap. */
+Image_Result Image_read_format_memory_JPEG_const(Image *image,
+	const uint8_t *start, const uint8_t *end,
+	const JPEGDecoder_Options *options);
+Image_Result Image_read_format_file_JPEG_options(Image *image, FILE *file,
+	const JPEGDecoder_Options *options);
+
+/* reusable decoder, for decoding many images one after another : the
+	decoder's scratch buffers are kept from one decode to the next and only
+	grown when an image needs more, and when the same image is decoded into
+	again its pixels are reused if they are big enough.  The image owns its
+	pixels as usual, Image_destruct frees them and clears the pointer.  The
+	image is recognised by its pointer alone, so don't decode into a copy
+	of an Image struct whose pixels were freed through another copy.  A
+	context is for one thread at a time. */
+typedef struct JPEGContext_t JPEGContext;
+
+JPEGContext *JPEGContext_new(void);
+void JPEGContext_delete(JPEGContext *this);
+Image_Result JPEGContext_read_memory(JPEGContext *this, Image *image,
+	const uint8_t *start, const uint8_t *end,
+	const JPEGDecoder_Options *options);
+Image_Result JPEGContext_read_file(JPEGContext *this, Image *image,
+	FILE *file, const JPEGDecoder_Options *options);
+
+/* index the scan of a JPEG file, with an entry every 'interval' MCUs (0 for
+	every 32, a few kB of index per megapixel), by entropy decoding it
+	once.  NULL if the file can't be decoded or out of memory. */
+JPEGIndex *JPEGIndex_build(const uint8_t *start, const uint8_t *end,
+	unsigned interval);
+JPEGIndex *JPEGIndex_build_file(FILE *file, unsigned interval);
+void JPEGIndex_delete(JPEGIndex *this);
+/* save an index to a sidecar file, and load it back for later decodes */
+Image_Result JPEGIndex_write(const JPEGIndex *this, FILE *file);
+JPEGIndex *JPEGIndex_read(FILE *file);
+
+/* coarse statistics of an image for sorting and classifying it, from the DC
+	term of each block alone : the AC terms are stepped over by the entropy
+	decoder and never dequantised or transformed */
+typedef struct JPEGStats_t {
+	/* each block's DC as the mean of its samples : one plane per component
+		at its own resolution, Y then Cb then Cr, as I420 output at 1/8 */
+	Image dc;
+	/* the image at 1/8 size in BGR, the chroma replicated where it is
+		subsampled */
+	Image preview;
+	double mean[3]; /* of the preview's B, G and R */
+	uint32_t histogram[256]; /* of the luma DC of the blocks in the image */
+} JPEGStats;
+
+void JPEGStats_construct(JPEGStats *this);
+void JPEGStats_destruct(JPEGStats *this);
+/* options may be NULL; only 'idct', 'index', 'threads' and 'pipeline' are
+	used */
+Image_Result JPEGStats_read_memory(JPEGStats *this, const uint8_t *start,
+	const uint8_t *end, const JPEGDecoder_Options *options);
+Image_Result JPEGStats_read_file(JPEGStats *this, FILE *file,
+	const JPEGDecoder_Options *options);
+
+/* what a file's headers say about it, without decoding anything : the
+	marker segments are walked up to the scan and only SOF, DRI and an EXIF
+	APP1 are looked at */
+typedef struct JPEGInfo_t {
+	unsigned width, height, components;
+	unsigned precision; /* bits per sample */
+	/* identifiers and sampling factors of the first (up to) four
+		components, in SOF order */
+	unsigned id[4], sub_x[4], sub_y[4];
+	/* SOFn marker, 0xc0 baseline to 0xcf, and what it says about the coding */
+	unsigned sof;
+	int progressive, arithmetic;
+	unsigned restart_interval; /* MCUs, 0 without a DRI */
+	int exif; /* there is an EXIF APP1 */
+	/* EXIF orientation, 1 (as stored) to 8, 0 if there is none */
+	unsigned orientation;
+	/* where the EXIF thumbnail's JPEG data is in the file, 0 if there is
+		none (from a FILE, also if it is described past the part of the APP1
+		which is read) */
+	size_t thumbnail_offset, thumbnail_size;
+	int supported; /* this decoder can decode it */
+} JPEGInfo;
+
+/* fail if there is no SOF before the scan.  Nothing is allocated.  The file
+	is read from its current position, and only as far as the scan, with
+	the segments not looked at skipped and only the first few kB of those
+	which are read. */
+Image_Result JPEGInfo_read_memory(JPEGInfo *this, const uint8_t *start,
+	const uint8_t *end);
+Image_Result JPEGInfo_read_file(JPEGInfo *this, FILE *file);
+
+/* preview decoding : an image at least 'width' x 'height' (as stored, before
+	any EXIF orientation), or the whole image if it is smaller.  The EXIF
+	thumbnail is decoded if it is big enough and can be decoded, otherwise
+	the image itself at the smallest scale which is, so only as much is
+	decoded as the preview needs.  options->scale is chosen here and any
+	crop is ignored; options->coefficients can't be used. */
+Image_Result JPEGThumbnail_read_memory(Image *image, const uint8_t *start,
+	const uint8_t *end, unsigned width, unsigned height,
+	const JPEGDecoder_Options *options);
+Image_Result JPEGThumbnail_read_file(Image *image, FILE *file,
+	unsigned width, unsigned height, const JPEGDecoder_Options *options);
+
+/* incremental decoder : the file is pushed in chunks of any size as it
+	arrives, and each MCU row is decoded as soon as all of its data is in,
+	then passed to options->rows.  Decoding happens on the pushing thread,
+	options->threads and options->pipeline are not used. */
+typedef struct JPEGStream_t JPEGStream;
+
+JPEGStream *JPEGStream_new(Image *image, const JPEGDecoder_Options *options);
+void JPEGStream_delete(JPEGStream *this);
+/* fails on a stream which cannot be decoded, or out of memory */
+Image_Result JPEGStream_push(JPEGStream *this, const uint8_t *data,
+	size_t size);
+/* no more data is coming, the rest of a truncated scan is decoded as if it
+	were zeros.  Fails unless the whole image was decoded. */
+Image_Result JPEGStream_finish(JPEGStream *this);
+int JPEGStream_done(const JPEGStream *this);
+
+#endif
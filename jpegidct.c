@@ -0,0 +1,578 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "jpegidct.h"
+
+#define DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+static uint8_t clamp_sample(int x)
+{
+	x += 128;
+	if (x < 0) { return 0; }
+	if (x > 255) { return 255; }
+	return x;
+}
+
+/* 1-D ISLOW transform of in0..in7, leaving the even (tmp10..tmp13) and odd
+	(tmp0..tmp3) halves for the caller to combine and descale */
+#define ISLOW_1D(in0, in1, in2, in3, in4, in5, in6, in7) \
+	z2 = in2; \
+	z3 = in6; \
+	z1 = (z2 + z3) * FIX_0_541196100; \
+	tmp2 = z1 - z3 * FIX_1_847759065; \
+	tmp3 = z1 + z2 * FIX_0_765366865; \
+	z2 = in0; \
+	z3 = in4; \
+	tmp0 = (z2 + z3) * (1 << CONST_BITS); \
+	tmp1 = (z2 - z3) * (1 << CONST_BITS); \
+	tmp10 = tmp0 + tmp3; \
+	tmp13 = tmp0 - tmp3; \
+	tmp11 = tmp1 + tmp2; \
+	tmp12 = tmp1 - tmp2; \
+	tmp0 = in7; \
+	tmp1 = in5; \
+	tmp2 = in3; \
+	tmp3 = in1; \
+	z1 = tmp0 + tmp3; \
+	z2 = tmp1 + tmp2; \
+	z3 = tmp0 + tmp2; \
+	z4 = tmp1 + tmp3; \
+	z5 = (z3 + z4) * FIX_1_175875602; \
+	tmp0 *= FIX_0_298631336; \
+	tmp1 *= FIX_2_053119869; \
+	tmp2 *= FIX_3_072711026; \
+	tmp3 *= FIX_1_501321110; \
+	z1 *= -FIX_0_899976223; \
+	z2 *= -FIX_2_562915447; \
+	z3 = z3 * -FIX_1_961570560 + z5; \
+	z4 = z4 * -FIX_0_390180644 + z5; \
+	tmp0 += z1 + z3; \
+	tmp1 += z2 + z4; \
+	tmp2 += z2 + z3; \
+	tmp3 += z1 + z4;
+
+void JPEGIDCT_islow(const int16_t *coef, uint8_t *out, unsigned stride)
+{
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	int ws[64], *w, x, y, dc;
+	const int16_t *in;
+
+	/* columns, scaled up by PASS1_BITS */
+	for (x = 0; x < 8; x++) {
+		in = coef + x;
+		w = ws + x;
+
+		if ((in[8]|in[16]|in[24]|in[32]|in[40]|in[48]|in[56]) == 0) {
+			dc = in[0] * (1 << PASS1_BITS);
+			w[0] = w[8] = w[16] = w[24] = w[32] = w[40] = w[48] = w[56] = dc;
+			continue;
+		}
+
+		ISLOW_1D(in[0], in[8], in[16], in[24], in[32], in[40], in[48], in[56])
+
+		w[0] = DESCALE(tmp10 + tmp3, CONST_BITS - PASS1_BITS);
+		w[56] = DESCALE(tmp10 - tmp3, CONST_BITS - PASS1_BITS);
+		w[8] = DESCALE(tmp11 + tmp2, CONST_BITS - PASS1_BITS);
+		w[48] = DESCALE(tmp11 - tmp2, CONST_BITS - PASS1_BITS);
+		w[16] = DESCALE(tmp12 + tmp1, CONST_BITS - PASS1_BITS);
+		w[40] = DESCALE(tmp12 - tmp1, CONST_BITS - PASS1_BITS);
+		w[24] = DESCALE(tmp13 + tmp0, CONST_BITS - PASS1_BITS);
+		w[32] = DESCALE(tmp13 - tmp0, CONST_BITS - PASS1_BITS);
+	}
+
+	/* rows, removing PASS1_BITS and the factor of 8 */
+	for (y = 0; y < 8; y++) {
+		w = ws + y*8;
+
+		ISLOW_1D(w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7])
+
+		out[0] = clamp_sample(DESCALE(tmp10 + tmp3, CONST_BITS + PASS1_BITS + 3));
+		out[7] = clamp_sample(DESCALE(tmp10 - tmp3, CONST_BITS + PASS1_BITS + 3));
+		out[1] = clamp_sample(DESCALE(tmp11 + tmp2, CONST_BITS + PASS1_BITS + 3));
+		out[6] = clamp_sample(DESCALE(tmp11 - tmp2, CONST_BITS + PASS1_BITS + 3));
+		out[2] = clamp_sample(DESCALE(tmp12 + tmp1, CONST_BITS + PASS1_BITS + 3));
+		out[5] = clamp_sample(DESCALE(tmp12 - tmp1, CONST_BITS + PASS1_BITS + 3));
+		out[3] = clamp_sample(DESCALE(tmp13 + tmp0, CONST_BITS + PASS1_BITS + 3));
+		out[4] = clamp_sample(DESCALE(tmp13 - tmp0, CONST_BITS + PASS1_BITS + 3));
+		out += stride;
+	}
+}
+
+/* JPEGIDCT_islow of a block whose nonzero coefficients are all within its
+	top left n x n, n being a constant : only n columns need the first pass,
+	and the zero inputs drop out of both.  Bit-exact with the full one. */
+#define SPARSE_IN(i) ((i) < n ? in[(i)*8] : 0)
+#define SPARSE_WS(i) ((i) < n ? w[i] : 0)
+
+static inline __attribute__((always_inline)) void islow_sparse(
+	const int16_t *coef, uint8_t *out, unsigned stride, const int n)
+{
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	int ws[64], *w, x, y;
+	const int16_t *in;
+
+	for (x = 0; x < n; x++) {
+		in = coef + x;
+		w = ws + x;
+
+		ISLOW_1D(SPARSE_IN(0), SPARSE_IN(1), SPARSE_IN(2), SPARSE_IN(3),
+			SPARSE_IN(4), SPARSE_IN(5), SPARSE_IN(6), SPARSE_IN(7))
+
+		w[0] = DESCALE(tmp10 + tmp3, CONST_BITS - PASS1_BITS);
+		w[56] = DESCALE(tmp10 - tmp3, CONST_BITS - PASS1_BITS);
+		w[8] = DESCALE(tmp11 + tmp2, CONST_BITS - PASS1_BITS);
+		w[48] = DESCALE(tmp11 - tmp2, CONST_BITS - PASS1_BITS);
+		w[16] = DESCALE(tmp12 + tmp1, CONST_BITS - PASS1_BITS);
+		w[40] = DESCALE(tmp12 - tmp1, CONST_BITS - PASS1_BITS);
+		w[24] = DESCALE(tmp13 + tmp0, CONST_BITS - PASS1_BITS);
+		w[32] = DESCALE(tmp13 - tmp0, CONST_BITS - PASS1_BITS);
+	}
+
+	for (y = 0; y < 8; y++) {
+		w = ws + y*8;
+
+		ISLOW_1D(SPARSE_WS(0), SPARSE_WS(1), SPARSE_WS(2), SPARSE_WS(3),
+			SPARSE_WS(4), SPARSE_WS(5), SPARSE_WS(6), SPARSE_WS(7))
+
+		out[0] = clamp_sample(DESCALE(tmp10 + tmp3, CONST_BITS + PASS1_BITS + 3));
+		out[7] = clamp_sample(DESCALE(tmp10 - tmp3, CONST_BITS + PASS1_BITS + 3));
+		out[1] = clamp_sample(DESCALE(tmp11 + tmp2, CONST_BITS + PASS1_BITS + 3));
+		out[6] = clamp_sample(DESCALE(tmp11 - tmp2, CONST_BITS + PASS1_BITS + 3));
+		out[2] = clamp_sample(DESCALE(tmp12 + tmp1, CONST_BITS + PASS1_BITS + 3));
+		out[5] = clamp_sample(DESCALE(tmp12 - tmp1, CONST_BITS + PASS1_BITS + 3));
+		out[3] = clamp_sample(DESCALE(tmp13 + tmp0, CONST_BITS + PASS1_BITS + 3));
+		out[4] = clamp_sample(DESCALE(tmp13 - tmp0, CONST_BITS + PASS1_BITS + 3));
+		out += stride;
+	}
+}
+
+#undef SPARSE_IN
+#undef SPARSE_WS
+
+void JPEGIDCT_dc(const JPEGIDCTBlock *block, unsigned size)
+{
+	uint8_t *out = block->out;
+	uint64_t v;
+	unsigned y;
+
+	v = clamp_sample(DESCALE(block->coef[0], 3));
+	if (size != 8) {
+		for (y = 0; y < size; y++, out += block->stride)
+			memset(out, v, size);
+		return;
+	}
+
+	/* a row in one store */
+	v *= 0x0101010101010101ull;
+	for (y = 0; y < 8; y++, out += block->stride)
+		memcpy(out, &v, 8);
+}
+
+void JPEGIDCT_islow_blocks(const JPEGIDCTBlock *blocks, unsigned n)
+{
+	for (; n; n--, blocks++) {
+		switch (blocks->support) {
+		case 1:
+			JPEGIDCT_dc(blocks, 8);
+			break;
+		case 2:
+			islow_sparse(blocks->coef, blocks->out, blocks->stride, 2);
+			break;
+		case 4:
+			islow_sparse(blocks->coef, blocks->out, blocks->stride, 4);
+			break;
+		default:
+			JPEGIDCT_islow(blocks->coef, blocks->out, blocks->stride);
+			break;
+		}
+	}
+}
+
+/* constants of the reduced size IDCTs */
+#define FIX_0_211164243 1730
+#define FIX_0_509795579 4176
+#define FIX_0_601344887 4926
+#define FIX_0_720959822 5906
+#define FIX_0_850430095 6967
+#define FIX_1_061594337 8697
+#define FIX_1_272758580 10426
+#define FIX_1_451774981 11893
+#define FIX_2_172734803 17799
+#define FIX_3_624509785 29692
+
+/* odd part of the 4-point output from the odd inputs of an 8-point column or
+	row */
+#define ODD_4x4(in1, in3, in5, in7) \
+	tmp0 = (in7) * -FIX_0_211164243 + (in5) * FIX_1_451774981 \
+		+ (in3) * -FIX_2_172734803 + (in1) * FIX_1_061594337; \
+	tmp2 = (in7) * -FIX_0_509795579 + (in5) * -FIX_0_601344887 \
+		+ (in3) * FIX_0_899976223 + (in1) * FIX_2_562915447;
+
+void JPEGIDCT_4x4(const int16_t *coef, uint8_t *out, unsigned stride)
+{
+	int32_t tmp0, tmp2, tmp10, tmp12;
+	int ws[8*4], *w, x, y, dc;
+	const int16_t *in;
+
+	/* columns, to 4 rows; column 4 doesn't contribute to 4 outputs */
+	for (x = 0; x < 8; x++) {
+		if (x == 4)
+			continue;
+		in = coef + x;
+		w = ws + x;
+
+		if ((in[8]|in[16]|in[24]|in[40]|in[48]|in[56]) == 0) {
+			dc = in[0] * (1 << PASS1_BITS);
+			w[0] = w[8] = w[16] = w[24] = dc;
+			continue;
+		}
+
+		tmp0 = in[0] * (1 << (CONST_BITS + 1));
+		tmp2 = in[16] * FIX_1_847759065 - in[48] * FIX_0_765366865;
+		tmp10 = tmp0 + tmp2;
+		tmp12 = tmp0 - tmp2;
+
+		ODD_4x4(in[8], in[24], in[40], in[56])
+
+		w[0] = DESCALE(tmp10 + tmp2, CONST_BITS - PASS1_BITS + 1);
+		w[24] = DESCALE(tmp10 - tmp2, CONST_BITS - PASS1_BITS + 1);
+		w[8] = DESCALE(tmp12 + tmp0, CONST_BITS - PASS1_BITS + 1);
+		w[16] = DESCALE(tmp12 - tmp0, CONST_BITS - PASS1_BITS + 1);
+	}
+
+	for (y = 0; y < 4; y++) {
+		w = ws + y*8;
+
+		tmp0 = w[0] * (1 << (CONST_BITS + 1));
+		tmp2 = w[2] * FIX_1_847759065 - w[6] * FIX_0_765366865;
+		tmp10 = tmp0 + tmp2;
+		tmp12 = tmp0 - tmp2;
+
+		ODD_4x4(w[1], w[3], w[5], w[7])
+
+		out[0] = clamp_sample(DESCALE(tmp10 + tmp2, CONST_BITS + PASS1_BITS + 3 + 1));
+		out[3] = clamp_sample(DESCALE(tmp10 - tmp2, CONST_BITS + PASS1_BITS + 3 + 1));
+		out[1] = clamp_sample(DESCALE(tmp12 + tmp0, CONST_BITS + PASS1_BITS + 3 + 1));
+		out[2] = clamp_sample(DESCALE(tmp12 - tmp0, CONST_BITS + PASS1_BITS + 3 + 1));
+		out += stride;
+	}
+}
+
+#define ODD_2x2(in1, in3, in5, in7) \
+	tmp0 = (in7) * -FIX_0_720959822 + (in5) * FIX_0_850430095 \
+		+ (in3) * -FIX_1_272758580 + (in1) * FIX_3_624509785;
+
+void JPEGIDCT_2x2(const int16_t *coef, uint8_t *out, unsigned stride)
+{
+	int32_t tmp0, tmp10;
+	int ws[8*2], *w, x, y, dc;
+	const int16_t *in;
+
+	/* columns, to 2 rows; only the odd columns and DC contribute */
+	for (x = 0; x < 8; x++) {
+		if (x == 2 || x == 4 || x == 6)
+			continue;
+		in = coef + x;
+		w = ws + x;
+
+		if ((in[8]|in[24]|in[40]|in[56]) == 0) {
+			dc = in[0] * (1 << PASS1_BITS);
+			w[0] = w[8] = dc;
+			continue;
+		}
+
+		tmp10 = in[0] * (1 << (CONST_BITS + 2));
+
+		ODD_2x2(in[8], in[24], in[40], in[56])
+
+		w[0] = DESCALE(tmp10 + tmp0, CONST_BITS - PASS1_BITS + 2);
+		w[8] = DESCALE(tmp10 - tmp0, CONST_BITS - PASS1_BITS + 2);
+	}
+
+	for (y = 0; y < 2; y++) {
+		w = ws + y*8;
+
+		tmp10 = w[0] * (1 << (CONST_BITS + 2));
+
+		ODD_2x2(w[1], w[3], w[5], w[7])
+
+		out[0] = clamp_sample(DESCALE(tmp10 + tmp0, CONST_BITS + PASS1_BITS + 3 + 2));
+		out[1] = clamp_sample(DESCALE(tmp10 - tmp0, CONST_BITS + PASS1_BITS + 3 + 2));
+		out += stride;
+	}
+}
+
+void JPEGIDCT_4x4_blocks(const JPEGIDCTBlock *blocks, unsigned n)
+{
+	for (; n; n--, blocks++) {
+		if (blocks->support == 1)
+			JPEGIDCT_dc(blocks, 4);
+		else
+			JPEGIDCT_4x4(blocks->coef, blocks->out, blocks->stride);
+	}
+}
+
+void JPEGIDCT_2x2_blocks(const JPEGIDCTBlock *blocks, unsigned n)
+{
+	for (; n; n--, blocks++) {
+		if (blocks->support == 1)
+			JPEGIDCT_dc(blocks, 2);
+		else
+			JPEGIDCT_2x2(blocks->coef, blocks->out, blocks->stride);
+	}
+}
+
+/* the DC term alone is the block's average */
+void JPEGIDCT_1x1_blocks(const JPEGIDCTBlock *blocks, unsigned n)
+{
+	for (; n; n--, blocks++)
+		blocks->out[0] = clamp_sample(DESCALE(blocks->coef[0], 3));
+}
+
+/* the AAN row and column factors of each coefficient, and 1/8 : the
+	scale factors 1, 1.387039845, 1.306562965, 1.175875602, 1, 0.785694958,
+	0.541196100, 0.275899379 of its column times those of its row */
+static const float aan_scale[64] = {
+	0.125f, 0.173379987f, 0.163320377f, 0.146984443f, 0.125f, 0.0982118696f, 0.0676495135f, 0.0344874226f,
+	0.173379987f, 0.240484968f, 0.226531878f, 0.203873292f, 0.173379987f, 0.136223778f, 0.0938325748f, 0.047835432f,
+	0.163320377f, 0.226531878f, 0.213388368f, 0.192044437f, 0.163320377f, 0.128319994f, 0.0883883536f, 0.0450599901f,
+	0.146984443f, 0.203873292f, 0.192044437f, 0.17283541f, 0.146984443f, 0.115484938f, 0.0795474052f, 0.0405529179f,
+	0.125f, 0.173379987f, 0.163320377f, 0.146984443f, 0.125f, 0.0982118696f, 0.0676495135f, 0.0344874226f,
+	0.0982118696f, 0.136223778f, 0.128319994f, 0.115484938f, 0.0982118696f, 0.077164568f, 0.0531518832f, 0.0270965938f,
+	0.0676495135f, 0.0938325748f, 0.0883883536f, 0.0795474052f, 0.0676495135f, 0.0531518832f, 0.0366116539f, 0.0186644588f,
+	0.0344874226f, 0.047835432f, 0.0450599901f, 0.0405529179f, 0.0344874226f, 0.0270965938f, 0.0186644588f, 0.00951505825f
+};
+
+static uint8_t IDCT_fast_out(float x)
+{
+	/* level shift and round, anything truncated upwards below 0 clamps to 0
+		anyway */
+	int v = (int)(x + 128.5f);
+	if (v < 0) { return 0; }
+	if (v > 255) { return 255; }
+	return v;
+}
+
+void JPEGIDCT_float(const int16_t *input, uint8_t *output, unsigned stride)
+{
+	const float *scale = aan_scale;
+	const int16_t *i;
+	uint8_t *o;
+	uint_fast8_t x, y;
+	float ws[64], *wsptr, dcval;
+	float t0, t1, t2, t3, t4, t5, t6, t7, t10, t11, t12, t13;
+	float z5, z10, z11, z12, z13;
+
+#define M_SQRT_2 (1.414213562f)
+
+	wsptr = ws;
+	i = input;
+
+	for (y = 0; y < 8; y++) {
+		if ((i[8]|i[16]|i[24]|i[32]|i[40]|i[48]|i[56]) == 0) {
+			dcval = i[0]*scale[0];
+			wsptr[0]  =	wsptr[8]  =	wsptr[16] =	wsptr[24] =
+			wsptr[32] =	wsptr[40] =	wsptr[48] =	wsptr[56] = dcval;
+			i++;
+			scale++;
+			wsptr++;
+			continue;
+		}
+
+		t0 = i[0] *scale[0];
+		t1 = i[16]*scale[16];
+		t2 = i[32]*scale[32];
+		t3 = i[48]*scale[48];
+
+		t10 = t0 + t2;
+		t11 = t0 - t2;
+		t13 = t1 + t3;
+		t12 = (t1 - t3) * M_SQRT_2 - t13;
+		t0 = t10 + t13;
+		t3 = t10 - t13;
+		t1 = t11 + t12;
+		t2 = t11 - t12;
+
+		t4 = i[8] *scale[8];
+		t5 = i[24]*scale[24];
+		t6 = i[40]*scale[40];
+		t7 = i[56]*scale[56];
+		z13 = t6 + t5;
+		z10 = t6 - t5;
+		z11 = t4 + t7;
+		z12 = t4 - t7;
+		t7 = z11 + z13;
+		t11= (z11 - z13) * M_SQRT_2;
+
+		z5 = (z10 + z12) * 1.847759065f;
+		t10 = 1.082392200f * z12 - z5;
+		t12 = -2.613125930f * z10 + z5;
+
+		t6 = t12 - t7;
+		t5 = t11 - t6;
+		t4 = t10 + t5;
+
+		wsptr[0]  = t0 + t7;
+		wsptr[56] = t0 - t7;
+		wsptr[8]  = t1 + t6;
+		wsptr[48] = t1 - t6;
+		wsptr[16] = t2 + t5;
+		wsptr[40] = t2 - t5;
+		wsptr[32] = t3 + t4;
+		wsptr[24] = t3 - t4;
+		i++;
+		scale++;
+		wsptr++;
+	}
+
+	o = output;
+	wsptr = ws;
+
+	for (x=0; x < 8; x++) {
+		t10 = wsptr[0] + wsptr[4];
+		t11 = wsptr[0] - wsptr[4];
+
+		t13 = wsptr[2] + wsptr[6];
+		t12 =(wsptr[2] - wsptr[6]) * M_SQRT_2 - t13;
+		t0 = t10 + t13;
+		t3 = t10 - t13;
+		t1 = t11 + t12;
+		t2 = t11 - t12;
+
+		z13 = wsptr[5] + wsptr[3];
+		z10 = wsptr[5] - wsptr[3];
+		z11 = wsptr[1] + wsptr[7];
+		z12 = wsptr[1] - wsptr[7];
+
+		t7 = z11 + z13;
+		t11= (z11 - z13) * M_SQRT_2;
+
+		z5 = (z10 + z12) * 1.847759065f;
+		t10 = 1.082392200f * z12 - z5;
+		t12 = -2.613125930f * z10 + z5;
+
+		t6 = t12 - t7;
+		t5 = t11 - t6;
+		t4 = t10 + t5;
+
+		o[0] = IDCT_fast_out(t0 + t7);
+		o[7] = IDCT_fast_out(t0 - t7);
+		o[1] = IDCT_fast_out(t1 + t6);
+		o[6] = IDCT_fast_out(t1 - t6);
+		o[2] = IDCT_fast_out(t2 + t5);
+		o[5] = IDCT_fast_out(t2 - t5);
+		o[4] = IDCT_fast_out(t3 + t4);
+		o[3] = IDCT_fast_out(t3 - t4);
+
+		wsptr+=8;
+		o+=stride;
+	}
+}
+
+void JPEGIDCT_float_blocks(const JPEGIDCTBlock *blocks, unsigned n)
+{
+	uint8_t *out;
+	uint8_t v;
+	unsigned y;
+
+	for (; n; n--, blocks++) {
+		if (blocks->support != 1) {
+			JPEGIDCT_float(blocks->coef, blocks->out, blocks->stride);
+			continue;
+		}
+		/* flat, as the float IDCT rounds it */
+		v = IDCT_fast_out(blocks->coef[0] * aan_scale[0]);
+		for (y = 0, out = blocks->out; y < 8; y++, out += blocks->stride)
+			memset(out, v, 8);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static int cpu_has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int cpu_has_avx2(void)
+{
+	/* also checks the OS saves the YMM registers */
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const JPEGIDCTEngine engines[JPEGDECODER_IDCT_COUNT] = {
+	{ "auto", NULL },
+	{ "islow", JPEGIDCT_islow_blocks },
+	{ "float", JPEGIDCT_float_blocks },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse2", JPEGIDCT_islow_sse2_blocks },
+	{ "avx2", JPEGIDCT_islow_avx2_blocks }
+#else
+	{ "sse2", NULL },
+	{ "avx2", NULL }
+#endif
+};
+
+int JPEGDecoder_IDCT_supported(JPEGDecoder_IDCT idct)
+{
+	switch (idct) {
+	case JPEGDECODER_IDCT_AUTO:
+	case JPEGDECODER_IDCT_ISLOW:
+	case JPEGDECODER_IDCT_FLOAT:
+		return 1;
+#if defined(__x86_64__) || defined(__i386__)
+	case JPEGDECODER_IDCT_SSE2:
+		return cpu_has_sse2();
+	case JPEGDECODER_IDCT_AVX2:
+		return cpu_has_avx2();
+#endif
+	default:
+		return 0;
+	}
+}
+
+JPEGDecoder_IDCT JPEGDecoder_IDCT_best(void)
+{
+	/* checked once, the answer can't change while we run */
+	static JPEGDecoder_IDCT best = JPEGDECODER_IDCT_AUTO;
+
+	if (best == JPEGDECODER_IDCT_AUTO) {
+		if (JPEGDecoder_IDCT_supported(JPEGDECODER_IDCT_AVX2))
+			best = JPEGDECODER_IDCT_AVX2;
+		else if (JPEGDecoder_IDCT_supported(JPEGDECODER_IDCT_SSE2))
+			best = JPEGDECODER_IDCT_SSE2;
+		else
+			best = JPEGDECODER_IDCT_ISLOW;
+	}
+
+	return best;
+}
+
+const char *JPEGDecoder_IDCT_name(JPEGDecoder_IDCT idct)
+{
+	if (idct >= JPEGDECODER_IDCT_COUNT)
+		return "unknown";
+	return engines[idct].name;
+}
+
+JPEGDecoder_IDCT JPEGDecoder_IDCT_from_name(const char *name)
+{
+	int i;
+	for (i = 0; i < JPEGDECODER_IDCT_COUNT; i++)
+		if (strcmp(engines[i].name, name) == 0)
+			return i;
+	return JPEGDECODER_IDCT_COUNT;
+}
+
+const JPEGIDCTEngine *JPEGIDCT_engine(JPEGDecoder_IDCT idct)
+{
+	if (idct == JPEGDECODER_IDCT_AUTO)
+		idct = JPEGDecoder_IDCT_best();
+	if (!JPEGDecoder_IDCT_supported(idct))
+		return NULL;
+	return &engines[idct];
+}
@@ -0,0 +1,86 @@
+#ifndef INCLUDE_JPEGIDCT_H
+#define INCLUDE_JPEGIDCT_H
+
+#include <stdint.h>
+
+#include "jpegdecoder.h"
+
+/* fixed-point constants of the ISLOW IDCT, FIX(x) = x * 2^CONST_BITS */
+#define CONST_BITS 13
+#define PASS1_BITS 2
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+/* one 8x8 block for the batched IDCT entry points.  The entropy decoder
+	dequantises as it goes, so the engines take no quantisation table;
+	products which don't fit 16 bits (never in a valid 8-bit file) wrap. */
+typedef struct JPEGIDCTBlock_t {
+	const int16_t *coef; /* 64 dequantised coefficients, natural order */
+	uint8_t *out; /* top left output sample */
+	unsigned stride; /* bytes between output rows */
+	/* 1, 2, 4 or 8 : the nonzero coefficients are all within the top left
+		support x support of the block, from where the entropy decoder found
+		them.  Engines use it to skip the terms which are known to be zero. */
+	unsigned support;
+} JPEGIDCTBlock;
+
+typedef struct JPEGIDCTEngine_t {
+	const char *name;
+	void (*blocks)(const JPEGIDCTBlock *blocks, unsigned n);
+} JPEGIDCTEngine;
+
+/* engine for 'idct' (AUTO resolved through cpuid), NULL if this CPU or build
+	cannot run it */
+const JPEGIDCTEngine *JPEGIDCT_engine(JPEGDecoder_IDCT idct);
+
+/*
+Fixed-point integer IDCT (libjpeg "ISLOW" algorithm, 13-bit constants and 2
+extra bits of precision between passes) on int16 coefficients.  Each call
+transforms and writes level-shifted, saturated 8-bit samples.
+*/
+void JPEGIDCT_islow(const int16_t *coef, uint8_t *out, unsigned stride);
+void JPEGIDCT_islow_blocks(const JPEGIDCTBlock *blocks, unsigned n);
+
+/* a block with only its DC term is flat : fill size x size samples with
+	what JPEGIDCT_islow (or a reduced size version) would give for it */
+void JPEGIDCT_dc(const JPEGIDCTBlock *block, unsigned size);
+
+/*
+Reduced size versions of JPEGIDCT_islow for decoding at 1/2, 1/4 and 1/8
+scale, as libjpeg's jidctred.c : the same 64 coefficients in, 4x4, 2x2 or
+a single sample out.  The 1x1 one only looks at the DC.
+*/
+void JPEGIDCT_4x4(const int16_t *coef, uint8_t *out, unsigned stride);
+void JPEGIDCT_2x2(const int16_t *coef, uint8_t *out, unsigned stride);
+void JPEGIDCT_4x4_blocks(const JPEGIDCTBlock *blocks, unsigned n);
+void JPEGIDCT_2x2_blocks(const JPEGIDCTBlock *blocks, unsigned n);
+void JPEGIDCT_1x1_blocks(const JPEGIDCTBlock *blocks, unsigned n);
+
+void JPEGIDCT_float(const int16_t *coef, uint8_t *out, unsigned stride);
+void JPEGIDCT_float_blocks(const JPEGIDCTBlock *blocks, unsigned n);
+
+/*
+SIMD versions of JPEGIDCT_islow, bit-exact with it for coefficients in the
+range produced by 8-bit baseline images.
+
+The SSE2 kernel does one block per call, the AVX2 kernel two blocks at once
+(one per 128-bit lane), so the _blocks variants are the ones to use for a
+whole MCU.
+*/
+void JPEGIDCT_islow_sse2(const int16_t *coef, uint8_t *out, unsigned stride);
+void JPEGIDCT_islow_sse2_blocks(const JPEGIDCTBlock *blocks, unsigned n);
+
+void JPEGIDCT_islow_avx2_blocks(const JPEGIDCTBlock *blocks, unsigned n);
+
+#endif
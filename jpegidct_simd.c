@@ -0,0 +1,101 @@
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "jpegidct.h"
+
+#define VEC __m128i
+#define V(op) _mm_##op
+#define TPL(name) name##_sse2
+#define TARGET __attribute__((target("sse2")))
+#include "jpegidct_simd.h"
+#undef VEC
+#undef V
+#undef TPL
+#undef TARGET
+
+#define VEC __m256i
+#define V(op) _mm256_##op
+#define TPL(name) name##_avx2
+#define TARGET __attribute__((target("avx2")))
+#include "jpegidct_simd.h"
+#undef VEC
+#undef V
+#undef TPL
+#undef TARGET
+
+__attribute__((target("sse2")))
+void JPEGIDCT_islow_sse2(const int16_t *coef, uint8_t *out, unsigned stride)
+{
+	__m128i r[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm_loadu_si128((const __m128i *)(coef + i*8));
+
+	idct_8x8_sse2(r);
+
+	for (i = 0; i < 8; i++)
+		_mm_storel_epi64((__m128i *)(out + i*stride), r[i]);
+}
+
+void JPEGIDCT_islow_sse2_blocks(const JPEGIDCTBlock *blocks, unsigned n)
+{
+	for (; n; n--, blocks++) {
+		if (blocks->support == 1)
+			JPEGIDCT_dc(blocks, 8);
+		else
+			JPEGIDCT_islow_sse2(blocks->coef, blocks->out, blocks->stride);
+	}
+}
+
+__attribute__((target("avx2")))
+static __m256i load2_avx2(const int16_t *a, const int16_t *b)
+{
+	return _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)a)),
+		_mm_loadu_si128((const __m128i *)b), 1);
+}
+
+/* blocks a and b, one per lane */
+__attribute__((target("avx2")))
+static void islow_pair_avx2(const JPEGIDCTBlock *a, const JPEGIDCTBlock *b)
+{
+	__m256i r[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = load2_avx2(a->coef + i*8, b->coef + i*8);
+
+	idct_8x8_avx2(r);
+
+	for (i = 0; i < 8; i++) {
+		_mm_storel_epi64((__m128i *)(a->out + i*a->stride),
+			_mm256_castsi256_si128(r[i]));
+		_mm_storel_epi64((__m128i *)(b->out + i*b->stride),
+			_mm256_extracti128_si256(r[i], 1));
+	}
+}
+
+void JPEGIDCT_islow_avx2_blocks(const JPEGIDCTBlock *blocks, unsigned n)
+{
+	const JPEGIDCTBlock *pending = NULL;
+
+	/* flat blocks are filled, the rest paired up as they come */
+	for (; n; n--, blocks++) {
+		if (blocks->support == 1) {
+			JPEGIDCT_dc(blocks, 8);
+		} else if (!pending) {
+			pending = blocks;
+		} else {
+			islow_pair_avx2(pending, blocks);
+			pending = NULL;
+		}
+	}
+
+	if (pending)
+		JPEGIDCT_islow_sse2(pending->coef, pending->out, pending->stride);
+}
+
+#endif
@@ -0,0 +1,153 @@
+/*
+SIMD integer IDCT kernel, included by jpegidct_simd.c once per instruction set
+with these defined :
+
+	VEC          vector type
+	V(op)        intrinsic name, e.g. V(add_epi16) -> _mm_add_epi16
+	TPL(name)    function name with the instruction set suffix
+	TARGET       function attribute enabling the instruction set
+
+Each 128-bit lane holds one row of one 8x8 block as int16, so the AVX2
+instantiation transforms two blocks side by side with the same code.
+*/
+
+/* pair of 16-bit multipliers for madd : a*c0 + b*c1 on unpacked (a,b) */
+#define PAIR(c0, c1) V(set1_epi32)((int)(((uint32_t)(c1) << 16) | ((c0) & 0xffff)))
+
+/* one 1-D pass over 8 rows of lanes, descaling the result by 'shift' */
+static inline __attribute__((always_inline)) TARGET void TPL(idct_pass)(
+	VEC *r, const int shift)
+{
+	VEC lo, hi, x0, x1, z3, z4;
+	VEC t10l, t10h, t11l, t11h, t12l, t12h, t13l, t13h;
+	VEC t0l, t0h, t1l, t1h, t2l, t2h, t3l, t3h;
+	VEC z3l, z3h, z4l, z4h, round;
+
+	round = V(set1_epi32)(1 << (shift - 1));
+
+	/* even part */
+	lo = V(unpacklo_epi16)(r[2], r[6]);
+	hi = V(unpackhi_epi16)(r[2], r[6]);
+	x0 = PAIR(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100);
+	x1 = PAIR(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065);
+	t3l = V(madd_epi16)(lo, x0);
+	t3h = V(madd_epi16)(hi, x0);
+	t2l = V(madd_epi16)(lo, x1);
+	t2h = V(madd_epi16)(hi, x1);
+
+	lo = V(unpacklo_epi16)(r[0], r[4]);
+	hi = V(unpackhi_epi16)(r[0], r[4]);
+	x0 = PAIR(1 << CONST_BITS, 1 << CONST_BITS);
+	x1 = PAIR(1 << CONST_BITS, -(1 << CONST_BITS));
+	t0l = V(madd_epi16)(lo, x0);
+	t0h = V(madd_epi16)(hi, x0);
+	t1l = V(madd_epi16)(lo, x1);
+	t1h = V(madd_epi16)(hi, x1);
+
+	t10l = V(add_epi32)(t0l, t3l);
+	t10h = V(add_epi32)(t0h, t3h);
+	t13l = V(sub_epi32)(t0l, t3l);
+	t13h = V(sub_epi32)(t0h, t3h);
+	t11l = V(add_epi32)(t1l, t2l);
+	t11h = V(add_epi32)(t1h, t2h);
+	t12l = V(sub_epi32)(t1l, t2l);
+	t12h = V(sub_epi32)(t1h, t2h);
+
+	/* odd part, inputs are rows 7, 5, 3, 1 */
+	z3 = V(add_epi16)(r[7], r[3]);
+	z4 = V(add_epi16)(r[5], r[1]);
+	lo = V(unpacklo_epi16)(z3, z4);
+	hi = V(unpackhi_epi16)(z3, z4);
+	x0 = PAIR(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602);
+	x1 = PAIR(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644);
+	z3l = V(madd_epi16)(lo, x0);
+	z3h = V(madd_epi16)(hi, x0);
+	z4l = V(madd_epi16)(lo, x1);
+	z4h = V(madd_epi16)(hi, x1);
+
+	lo = V(unpacklo_epi16)(r[7], r[1]);
+	hi = V(unpackhi_epi16)(r[7], r[1]);
+	x0 = PAIR(FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223);
+	x1 = PAIR(-FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223);
+	t0l = V(add_epi32)(V(madd_epi16)(lo, x0), z3l);
+	t0h = V(add_epi32)(V(madd_epi16)(hi, x0), z3h);
+	t3l = V(add_epi32)(V(madd_epi16)(lo, x1), z4l);
+	t3h = V(add_epi32)(V(madd_epi16)(hi, x1), z4h);
+
+	lo = V(unpacklo_epi16)(r[5], r[3]);
+	hi = V(unpackhi_epi16)(r[5], r[3]);
+	x0 = PAIR(FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447);
+	x1 = PAIR(-FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447);
+	t1l = V(add_epi32)(V(madd_epi16)(lo, x0), z4l);
+	t1h = V(add_epi32)(V(madd_epi16)(hi, x0), z4h);
+	t2l = V(add_epi32)(V(madd_epi16)(lo, x1), z3l);
+	t2h = V(add_epi32)(V(madd_epi16)(hi, x1), z3h);
+
+#define DESCALE_PACK(l, h) V(packs_epi32)( \
+	V(srai_epi32)(V(add_epi32)(l, round), shift), \
+	V(srai_epi32)(V(add_epi32)(h, round), shift))
+
+	r[0] = DESCALE_PACK(V(add_epi32)(t10l, t3l), V(add_epi32)(t10h, t3h));
+	r[7] = DESCALE_PACK(V(sub_epi32)(t10l, t3l), V(sub_epi32)(t10h, t3h));
+	r[1] = DESCALE_PACK(V(add_epi32)(t11l, t2l), V(add_epi32)(t11h, t2h));
+	r[6] = DESCALE_PACK(V(sub_epi32)(t11l, t2l), V(sub_epi32)(t11h, t2h));
+	r[2] = DESCALE_PACK(V(add_epi32)(t12l, t1l), V(add_epi32)(t12h, t1h));
+	r[5] = DESCALE_PACK(V(sub_epi32)(t12l, t1l), V(sub_epi32)(t12h, t1h));
+	r[3] = DESCALE_PACK(V(add_epi32)(t13l, t0l), V(add_epi32)(t13h, t0h));
+	r[4] = DESCALE_PACK(V(sub_epi32)(t13l, t0l), V(sub_epi32)(t13h, t0h));
+
+#undef DESCALE_PACK
+}
+
+/* transpose the 8x8 int16 matrix in each 128-bit lane */
+static inline __attribute__((always_inline)) TARGET void TPL(transpose)(VEC *r)
+{
+	VEC a0, a1, a2, a3, a4, a5, a6, a7;
+	VEC b0, b1, b2, b3, b4, b5, b6, b7;
+
+	a0 = V(unpacklo_epi16)(r[0], r[1]);
+	a1 = V(unpackhi_epi16)(r[0], r[1]);
+	a2 = V(unpacklo_epi16)(r[2], r[3]);
+	a3 = V(unpackhi_epi16)(r[2], r[3]);
+	a4 = V(unpacklo_epi16)(r[4], r[5]);
+	a5 = V(unpackhi_epi16)(r[4], r[5]);
+	a6 = V(unpacklo_epi16)(r[6], r[7]);
+	a7 = V(unpackhi_epi16)(r[6], r[7]);
+
+	b0 = V(unpacklo_epi32)(a0, a2);
+	b1 = V(unpackhi_epi32)(a0, a2);
+	b2 = V(unpacklo_epi32)(a1, a3);
+	b3 = V(unpackhi_epi32)(a1, a3);
+	b4 = V(unpacklo_epi32)(a4, a6);
+	b5 = V(unpackhi_epi32)(a4, a6);
+	b6 = V(unpacklo_epi32)(a5, a7);
+	b7 = V(unpackhi_epi32)(a5, a7);
+
+	r[0] = V(unpacklo_epi64)(b0, b4);
+	r[1] = V(unpackhi_epi64)(b0, b4);
+	r[2] = V(unpacklo_epi64)(b1, b5);
+	r[3] = V(unpackhi_epi64)(b1, b5);
+	r[4] = V(unpacklo_epi64)(b2, b6);
+	r[5] = V(unpackhi_epi64)(b2, b6);
+	r[6] = V(unpacklo_epi64)(b3, b7);
+	r[7] = V(unpackhi_epi64)(b3, b7);
+}
+
+/* rows of dequantised coefficients in, rows of level-shifted samples (still
+	int16, saturated to 0-255) out */
+static inline __attribute__((always_inline)) TARGET void TPL(idct_8x8)(VEC *r)
+{
+	int i;
+	VEC bias = V(set1_epi16)(128);
+
+	/* columns first, then rows as libjpeg does */
+	TPL(idct_pass)(r, CONST_BITS - PASS1_BITS);
+	TPL(transpose)(r);
+	TPL(idct_pass)(r, CONST_BITS + PASS1_BITS + 3);
+	TPL(transpose)(r);
+
+	for (i = 0; i < 8; i++)
+		r[i] = V(packus_epi16)(V(adds_epi16)(r[i], bias), r[i]);
+}
+
+#undef PAIR